@@ -22,6 +22,13 @@
 #include "protocol.h"
 #include <math.h>
 
+/* Below the user's cache directory, see probe_cache_path(). */
+#define PROBE_CACHE_FILE	"cypress-fx3-probe.ini"
+#define PROBE_CACHE_SESSION	"session"
+
+/* How far apart two estimates of the host's boot time may be, in seconds. */
+#define BOOT_TIME_SLACK		2
+
 static const struct cypress_fx3_profile supported_fx3[] = {
 	/*
 	 * Cypress FX3
@@ -33,8 +40,17 @@ static const struct cypress_fx3_profile supported_fx3[] = {
 	ALL_ZERO
 };
 
+/* Exposed instead of any real device while the mock is enabled. */
+static const struct cypress_fx3_profile mock_fx3 = {
+	0x04b4, 0x1234, "Cypress", "FX3 (mock)", NULL, NULL,
+	DEV_CAPS_16BIT | DEV_CAPS_AX_ANALOG, NULL, NULL
+};
+
 static const uint32_t scanopts[] = {
 	SR_CONF_CONN,
+	FX3_CONF_MOCK_FILE,
+	FX3_CONF_MOCK_RATE,
+	FX3_CONF_MOCK_LATENCY,
 };
 
 static const uint32_t drvopts[] = {
@@ -42,13 +58,66 @@ static const uint32_t drvopts[] = {
 };
 
 static const uint32_t devopts[] = {
-	SR_CONF_CONTINUOUS,
+	SR_CONF_CONTINUOUS | SR_CONF_GET | SR_CONF_SET,
 	SR_CONF_LIMIT_FRAMES | SR_CONF_GET | SR_CONF_SET,
 	SR_CONF_LIMIT_SAMPLES | SR_CONF_GET | SR_CONF_SET,
+	SR_CONF_LIMIT_MSEC | SR_CONF_GET | SR_CONF_SET,
 	SR_CONF_CONN | SR_CONF_GET,
 	SR_CONF_SAMPLERATE | SR_CONF_GET | SR_CONF_SET | SR_CONF_LIST,
 	SR_CONF_TRIGGER_MATCH | SR_CONF_LIST,
 	SR_CONF_CAPTURE_RATIO | SR_CONF_GET | SR_CONF_SET,
+	FX3_CONF_QUEUE_DEPTH | SR_CONF_GET | SR_CONF_SET,
+	FX3_CONF_OVERFLOW_POLICY | SR_CONF_GET | SR_CONF_SET | SR_CONF_LIST,
+	FX3_CONF_OVERFLOW_COUNTERS | SR_CONF_GET,
+	FX3_CONF_ACQ_PROFILE | SR_CONF_GET | SR_CONF_SET | SR_CONF_LIST,
+	FX3_CONF_TRACE_FILE | SR_CONF_GET | SR_CONF_SET,
+	FX3_CONF_CPUS | SR_CONF_GET | SR_CONF_SET,
+	FX3_CONF_NUMA_NODE | SR_CONF_GET | SR_CONF_SET,
+	FX3_CONF_RT_PRIORITY | SR_CONF_GET | SR_CONF_SET,
+	FX3_CONF_MEMORY | SR_CONF_GET | SR_CONF_SET,
+	SR_CONF_TRIGGER_SOURCE | SR_CONF_GET | SR_CONF_SET | SR_CONF_LIST,
+	SR_CONF_TRIGGER_SLOPE | SR_CONF_GET | SR_CONF_SET | SR_CONF_LIST,
+	FX3_CONF_TRIGGER_BAND | SR_CONF_GET | SR_CONF_SET | SR_CONF_LIST,
+	FX3_CONF_RECORDER_WINDOW | SR_CONF_GET | SR_CONF_SET,
+	FX3_CONF_SPILL_FILE | SR_CONF_GET | SR_CONF_SET,
+	FX3_CONF_COMPRESS_MEMORY | SR_CONF_GET | SR_CONF_SET,
+};
+
+/* Acquisition profiles, in enum acq_profile order. */
+static const char *acq_profile_names[] = {
+	"throughput",
+	"latency",
+};
+
+/*
+ * Overflow policies of the transfer queue, in enum overflow_policy order.
+ * Note: No spaces allowed because of sigrok-cli.
+ */
+static const char *overflow_policies[] = {
+	"block",
+	"drop-oldest",
+	"drop-newest",
+	"decimate",
+};
+
+/* Memory flags, in the bit order of enum mem_flags. */
+static const char *mem_flag_names[] = {
+	"lock",
+	"thp",
+	"hugetlb",
+	"prefault",
+};
+
+/* Analog trigger source, "none" or a channel of the analog packets. */
+static const char *trigger_sources[] = {
+	"none", "A0", "A1", "A2", "A3", "A4", "A5", "A6", "A7",
+};
+
+/* Analog trigger slopes, in enum analog_trigger_slope order. */
+static const char *trigger_slopes[] = {
+	"r",
+	"f",
+	"window",
 };
 
 static const int32_t trigger_matches[] = {
@@ -83,48 +152,343 @@ static gboolean is_plausible(const struct libusb_device_descriptor *des)
 	return FALSE;
 }
 
-static GSList *scan(struct sr_dev_driver *di, GSList *options)
+static struct sr_dev_inst *dev_inst_new(const struct cypress_fx3_profile *prof,
+	const char *serial_num, const char *connection_id)
 {
-	struct drv_context *drvc;
 	struct dev_context *devc;
 	struct sr_dev_inst *sdi;
-	struct sr_usb_dev_inst *usb;
 	struct sr_channel *ch;
 	struct sr_channel_group *cg;
-	struct sr_config *src;
+	int j, num_logic_channels, num_analog_channels;
+	char channel_name[16];
+
+	sdi = g_malloc0(sizeof(struct sr_dev_inst));
+	sdi->status = SR_ST_INITIALIZING;
+	sdi->vendor = g_strdup(prof->vendor);
+	sdi->model = g_strdup(prof->model);
+	sdi->version = g_strdup(prof->model_version);
+	sdi->serial_num = g_strdup(serial_num);
+	sdi->connection_id = g_strdup(connection_id);
+
+	/* Fill in channellist according to this device's profile. */
+	num_logic_channels = prof->dev_caps & DEV_CAPS_16BIT ? 16 : 8;
+	num_analog_channels = prof->dev_caps & DEV_CAPS_AX_ANALOG ? 1 : 0;
+
+	/* Logic channels, all in one channel group. */
+	cg = g_malloc0(sizeof(struct sr_channel_group));
+	cg->name = g_strdup("Logic");
+	for (j = 0; j < num_logic_channels; j++) {
+		sprintf(channel_name, "D%d", j);
+		ch = sr_channel_new(sdi, j, SR_CHANNEL_LOGIC,
+					TRUE, channel_name);
+		cg->channels = g_slist_append(cg->channels, ch);
+	}
+	sdi->channel_groups = g_slist_append(NULL, cg);
+
+	for (j = 0; j < num_analog_channels; j++) {
+		snprintf(channel_name, 16, "A%d", j);
+		ch = sr_channel_new(sdi, j + num_logic_channels,
+				SR_CHANNEL_ANALOG, TRUE, channel_name);
+
+		/* Every analog channel gets its own channel group. */
+		cg = g_malloc0(sizeof(struct sr_channel_group));
+		cg->name = g_strdup(channel_name);
+		cg->channels = g_slist_append(NULL, ch);
+		sdi->channel_groups = g_slist_append(sdi->channel_groups, cg);
+	}
+
+	devc = cypress_fx3_dev_new();
+	devc->profile = prof;
+	devc->samplerates = samplerates;
+	devc->num_samplerates = ARRAY_SIZE(samplerates);
+	sdi->priv = devc;
+
+	return sdi;
+}
+
+/* What probe_thread() found out about one device. */
+struct probe {
+	struct drv_context *drvc;
+	libusb_device *dev;
+	/* Upload the firmware if it is missing. */
+	gboolean upload;
+	/* Profile, serial number and firmware state came from the cache. */
+	gboolean cached;
 	const struct cypress_fx3_profile *prof;
-	GSList *l, *devices, *conn_devices;
 	gboolean has_firmware;
+	int64_t fw_updated;
+	char serial_num[64];
+	char connection_id[64];
+};
+
+static void probe_free(struct probe *probe)
+{
+	libusb_unref_device(probe->dev);
+	g_free(probe);
+}
+
+/*
+ * The probe cache remembers what was read from a device, so that later
+ * scans need not open it again. Entries are keyed by port path and are
+ * only trusted while bus, address and device descriptor still match,
+ * i.e. until the device re-enumerates. After a reboot or suspend of the
+ * host, another board may come up at the same address, so the whole
+ * cache is dropped then, see boot_time().
+ */
+static char *probe_cache_path(void)
+{
+	return g_build_filename(g_get_user_cache_dir(), "libsigrok",
+		PROBE_CACHE_FILE, NULL);
+}
+
+/*
+ * When the host came up, in seconds. The monotonic clock does not run
+ * while the host is suspended, so this moves on resume as well.
+ */
+static int64_t boot_time(void)
+{
+	return (g_get_real_time() - g_get_monotonic_time()) / 1000000;
+}
+
+static GKeyFile *probe_cache_load(void)
+{
+	GKeyFile *cache;
+	char *path;
+	int64_t boot;
+
+	cache = g_key_file_new();
+	path = probe_cache_path();
+	/* A missing or unreadable cache is just empty. */
+	g_key_file_load_from_file(cache, path, G_KEY_FILE_NONE, NULL);
+	g_free(path);
+
+	boot = boot_time();
+	if (ABS(g_key_file_get_int64(cache, PROBE_CACHE_SESSION, "boot", NULL)
+			- boot) > BOOT_TIME_SLACK) {
+		sr_dbg("Probe cache is from another session, dropping it.");
+		g_key_file_free(cache);
+		cache = g_key_file_new();
+		g_key_file_set_int64(cache, PROBE_CACHE_SESSION, "boot", boot);
+	}
+
+	return cache;
+}
+
+static void probe_cache_save(GKeyFile *cache)
+{
+	GError *error;
+	char *dir, *path;
+
+	dir = g_build_filename(g_get_user_cache_dir(), "libsigrok", NULL);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	error = NULL;
+	path = probe_cache_path();
+	if (!g_key_file_save_to_file(cache, path, &error)) {
+		sr_dbg("Failed to save probe cache %s: %s.", path,
+		       error->message);
+		g_error_free(error);
+	}
+	g_free(path);
+}
+
+static gboolean probe_cache_lookup(GKeyFile *cache, struct probe *probe,
+	const struct libusb_device_descriptor *des)
+{
+	const char *group;
+	char *serial_num;
+	int prof;
+
+	group = probe->connection_id;
+	if (!g_key_file_has_group(cache, group))
+		return FALSE;
+
+	if (g_key_file_get_integer(cache, group, "bus", NULL)
+			!= libusb_get_bus_number(probe->dev)
+			|| g_key_file_get_integer(cache, group, "address", NULL)
+			!= libusb_get_device_address(probe->dev)
+			|| g_key_file_get_integer(cache, group, "vid", NULL)
+			!= des->idVendor
+			|| g_key_file_get_integer(cache, group, "pid", NULL)
+			!= des->idProduct
+			|| g_key_file_get_integer(cache, group, "bcd", NULL)
+			!= des->bcdDevice)
+		return FALSE;
+
+	prof = g_key_file_get_integer(cache, group, "profile", NULL);
+	if (prof < 0 || prof >= (int)ARRAY_SIZE(supported_fx3) - 1)
+		return FALSE;
+	if (!(serial_num = g_key_file_get_string(cache, group, "serial", NULL)))
+		return FALSE;
+
+	g_strlcpy(probe->serial_num, serial_num, sizeof(probe->serial_num));
+	g_free(serial_num);
+	probe->prof = &supported_fx3[prof];
+	probe->has_firmware = g_key_file_get_integer(cache, group,
+		"firmware", NULL);
+	probe->cached = TRUE;
+
+	return TRUE;
+}
+
+static void probe_cache_store(GKeyFile *cache, const struct probe *probe)
+{
+	struct libusb_device_descriptor des;
+	const char *group;
+
+	group = probe->connection_id;
+	libusb_get_device_descriptor(probe->dev, &des);
+
+	g_key_file_set_integer(cache, group, "bus",
+		libusb_get_bus_number(probe->dev));
+	g_key_file_set_integer(cache, group, "address",
+		libusb_get_device_address(probe->dev));
+	g_key_file_set_integer(cache, group, "vid", des.idVendor);
+	g_key_file_set_integer(cache, group, "pid", des.idProduct);
+	g_key_file_set_integer(cache, group, "bcd", des.bcdDevice);
+	g_key_file_set_integer(cache, group, "profile",
+		probe->prof - supported_fx3);
+	g_key_file_set_string(cache, group, "serial", probe->serial_num);
+	g_key_file_set_integer(cache, group, "firmware", probe->has_firmware);
+}
+
+/*
+ * Read the descriptors of one device and match it against the supported
+ * profiles. Returns FALSE if it is not one of ours.
+ */
+static gboolean probe_descriptors(struct probe *probe)
+{
 	struct libusb_device_descriptor des;
-	libusb_device **devlist;
 	struct libusb_device_handle *hdl;
-	int ret, i, j;
-	int num_logic_channels = 0, num_analog_channels = 0;
-	const char *conn;
-	char manufacturer[64], product[64], serial_num[64], connection_id[64];
-	char channel_name[16];
+	const struct cypress_fx3_profile *prof;
+	char manufacturer[64], product[64];
+	int ret, j;
 
-	drvc = di->context;
-	
-	conn = NULL;
-	for (l = options; l; l = l->next) {
-		src = l->data;
-		switch (src->key) {
-		case SR_CONF_CONN:
-			conn = g_variant_get_string(src->data, NULL);
+	libusb_get_device_descriptor(probe->dev, &des);
+
+	if ((ret = libusb_open(probe->dev, &hdl)) < 0) {
+		sr_warn("Failed to open potential device with "
+			"VID:PID %04x:%04x: %s.", des.idVendor,
+			des.idProduct, libusb_error_name(ret));
+		return FALSE;
+	}
+
+	if (des.iManufacturer == 0) {
+		manufacturer[0] = '\0';
+	} else if ((ret = libusb_get_string_descriptor_ascii(hdl,
+			des.iManufacturer, (unsigned char *) manufacturer,
+			sizeof(manufacturer))) < 0) {
+		sr_warn("Failed to get manufacturer string descriptor: %s.",
+			libusb_error_name(ret));
+		libusb_close(hdl);
+		return FALSE;
+	}
+
+	if (des.iProduct == 0) {
+		product[0] = '\0';
+	} else if ((ret = libusb_get_string_descriptor_ascii(hdl,
+			des.iProduct, (unsigned char *) product,
+			sizeof(product))) < 0) {
+		sr_warn("Failed to get product string descriptor: %s.",
+			libusb_error_name(ret));
+		libusb_close(hdl);
+		return FALSE;
+	}
+
+	if (des.iSerialNumber == 0) {
+		probe->serial_num[0] = '\0';
+	} else if ((ret = libusb_get_string_descriptor_ascii(hdl,
+			des.iSerialNumber, (unsigned char *) probe->serial_num,
+			sizeof(probe->serial_num))) < 0) {
+		sr_warn("Failed to get serial number string descriptor: %s.",
+			libusb_error_name(ret));
+		libusb_close(hdl);
+		return FALSE;
+	}
+
+	libusb_close(hdl);
+
+	prof = NULL;
+	for (j = 0; supported_fx3[j].vid; j++) {
+		if (des.idVendor == supported_fx3[j].vid &&
+				des.idProduct == supported_fx3[j].pid &&
+				(!supported_fx3[j].usb_manufacturer ||
+				 !strcmp(manufacturer, supported_fx3[j].usb_manufacturer)) &&
+				(!supported_fx3[j].usb_product ||
+				 !strcmp(product, supported_fx3[j].usb_product))) {
+			prof = &supported_fx3[j];
 			break;
 		}
 	}
-	if (conn)
-		conn_devices = sr_usb_find(drvc->sr_ctx->libusb_ctx, conn);
-	else
-		conn_devices = NULL;
-	
-	/* Find all cypress_fx3 compatible devices and upload firmware to them. */
-	devices = NULL;
-	libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
+
+	if (!prof)
+		return FALSE;
+
+	probe->has_firmware = usb_match_manuf_prod(probe->dev,
+			"sigrok", "cypress-fx3");
+	probe->prof = prof;
+
+	return TRUE;
+}
+
+/*
+ * Probe one device unless the cache knew it already and upload the
+ * firmware if needed. Runs in its own thread for every device, so that
+ * the slow parts overlap across boards.
+ */
+static gpointer probe_thread(gpointer data)
+{
+	struct probe *probe;
+	struct drv_context *drvc;
+	const struct cypress_fx3_profile *prof;
+
+	probe = data;
+	drvc = probe->drvc;
+
+	if (!probe->cached && !probe_descriptors(probe))
+		return NULL;
+	prof = probe->prof;
+
+	if (!probe->has_firmware && probe->upload) {
+		if (ezusb_upload_firmware_fx3(drvc->sr_ctx, probe->dev,
+				USB_CONFIGURATION, prof->firmware) == SR_OK) {
+			/* Store when this device's FW was updated. */
+			probe->fw_updated = g_get_monotonic_time();
+		} else {
+			sr_err("Firmware upload failed for "
+			       "device %d.%d (logical), name %s.",
+			       libusb_get_bus_number(probe->dev),
+			       libusb_get_device_address(probe->dev),
+			       prof->firmware);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Probe the plausible devices in the list concurrently. Only the devices
+ * matching conn_devices are looked at, if set. Returns the devices
+ * matching a supported profile.
+ */
+static GSList *probe_devices(struct drv_context *drvc, libusb_device **devlist,
+	GSList *conn_devices, gboolean upload)
+{
+	struct sr_usb_dev_inst *usb;
+	struct libusb_device_descriptor des;
+	struct probe *probe;
+	GKeyFile *cache;
+	GSList *l, *probes, *threads, *t, *found;
+	gboolean cache_changed;
+	char connection_id[64];
+	int i;
+
+	cache = probe_cache_load();
+	cache_changed = FALSE;
+	probes = threads = NULL;
 	for (i = 0; devlist[i]; i++) {
-		if (conn) {
+		if (conn_devices) {
 			usb = NULL;
 			for (l = conn_devices; l; l = l->next) {
 				usb = l->data;
@@ -139,145 +503,207 @@ static GSList *scan(struct sr_dev_driver *di, GSList *options)
 		}
 
 		libusb_get_device_descriptor( devlist[i], &des);
-		
+
 		if (!is_plausible(&des))
 			continue;
 
-		if ((ret = libusb_open(devlist[i], &hdl)) < 0) {
-			sr_warn("Failed to open potential device with "
-				"VID:PID %04x:%04x: %s.", des.idVendor,
-				des.idProduct, libusb_error_name(ret));
+		if (usb_get_port_path(devlist[i], connection_id,
+				sizeof(connection_id)) < 0)
 			continue;
-		}
 
-		if (des.iManufacturer == 0) {
-			manufacturer[0] = '\0';
-		} else if ((ret = libusb_get_string_descriptor_ascii(hdl,
-				des.iManufacturer, (unsigned char *) manufacturer,
-				sizeof(manufacturer))) < 0) {
-			sr_warn("Failed to get manufacturer string descriptor: %s.",
-				libusb_error_name(ret));
+		probe = g_malloc0(sizeof(struct probe));
+		probe->drvc = drvc;
+		probe->dev = libusb_ref_device(devlist[i]);
+		probe->upload = upload;
+		g_strlcpy(probe->connection_id, connection_id,
+			sizeof(probe->connection_id));
+		probes = g_slist_append(probes, probe);
+
+		/* Nothing left to do for a known device with firmware. */
+		if (probe_cache_lookup(cache, probe, &des)
+				&& (probe->has_firmware || !upload)) {
+			sr_spew("Probe cache hit for %s.", connection_id);
+			threads = g_slist_append(threads, NULL);
 			continue;
 		}
+		threads = g_slist_append(threads,
+			g_thread_try_new("cypress-fx3-probe", probe_thread,
+				probe, NULL));
+	}
 
-		if (des.iProduct == 0) {
-			product[0] = '\0';
-		} else if ((ret = libusb_get_string_descriptor_ascii(hdl,
-				des.iProduct, (unsigned char *) product,
-				sizeof(product))) < 0) {
-			sr_warn("Failed to get product string descriptor: %s.",
-				libusb_error_name(ret));
-			continue;
+	found = NULL;
+	for (l = probes, t = threads; l; l = l->next, t = t->next) {
+		probe = l->data;
+		if (t->data)
+			g_thread_join(t->data);
+		else if (!probe->cached
+				|| (!probe->has_firmware && probe->upload))
+			/* No thread, probe it right here. */
+			probe_thread(probe);
+		if (!probe->cached && probe->prof) {
+			probe_cache_store(cache, probe);
+			cache_changed = TRUE;
 		}
+		if (probe->prof)
+			found = g_slist_append(found, probe);
+		else
+			probe_free(probe);
+	}
+	g_slist_free(probes);
+	g_slist_free(threads);
 
-		if (des.iSerialNumber == 0) {
-			serial_num[0] = '\0';
-		} else if ((ret = libusb_get_string_descriptor_ascii(hdl,
-				des.iSerialNumber, (unsigned char *) serial_num,
-				sizeof(serial_num))) < 0) {
-			sr_warn("Failed to get serial number string descriptor: %s.",
-				libusb_error_name(ret));
-			continue;
-		}
+	if (cache_changed)
+		probe_cache_save(cache);
+	g_key_file_free(cache);
 
-		libusb_close(hdl);
+	return found;
+}
 
-		if (usb_get_port_path(devlist[i], connection_id, sizeof(connection_id)) < 0)
-			continue;
-		
-		prof = NULL;
-		for (j = 0; supported_fx3[j].vid; j++) {
-			if (des.idVendor == supported_fx3[j].vid &&
-					des.idProduct == supported_fx3[j].pid &&
-					(!supported_fx3[j].usb_manufacturer ||
-					 !strcmp(manufacturer, supported_fx3[j].usb_manufacturer)) &&
-					(!supported_fx3[j].usb_product ||
-					 !strcmp(product, supported_fx3[j].usb_product))) {
-				prof = &supported_fx3[j];
-				break;
-			}
-		}
+/* The mock device replaces all real ones, see mock.c. */
+static GSList *scan_mock(struct sr_dev_driver *di,
+	struct cypress_fx3_mock *mock)
+{
+	struct sr_dev_inst *sdi;
+	struct dev_context *devc;
 
-		if (!prof)
-			continue;
+	sdi = dev_inst_new(&mock_fx3, "", "mock");
+	sdi->status = SR_ST_INACTIVE;
+	sdi->inst_type = SR_INST_USB;
+	sdi->conn = sr_usb_dev_inst_new(0, 0, NULL);
+	devc = sdi->priv;
+	devc->mock = mock;
 
-		sdi = g_malloc0(sizeof(struct sr_dev_inst));
-		sdi->status = SR_ST_INITIALIZING;
-		sdi->vendor = g_strdup(prof->vendor);
-		sdi->model = g_strdup(prof->model);
-		sdi->version = g_strdup(prof->model_version);
-		sdi->serial_num = g_strdup(serial_num);
-		sdi->connection_id = g_strdup(connection_id);
+	return std_scan_complete(di, g_slist_append(NULL, sdi));
+}
 
-		/* Fill in channellist according to this device's profile. */
-		num_logic_channels = prof->dev_caps & DEV_CAPS_16BIT ? 16 : 8;
-		num_analog_channels = prof->dev_caps & DEV_CAPS_AX_ANALOG ? 1 : 0;
+static GSList *scan(struct sr_dev_driver *di, GSList *options)
+{
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_dev_inst *sdi;
+	struct sr_config *src;
+	struct renum_wait renum;
+	struct probe *probe, *back;
+	GSList *l, *m, *devices, *conn_devices, *probes, *reprobes;
+	libusb_device **devlist;
+	unsigned int num_uploaded;
+	int64_t fw_updated, mock_latency;
+	uint64_t mock_rate;
+	const char *conn, *mock_file;
 
-		/* Logic channels, all in one channel group. */
-		cg = g_malloc0(sizeof(struct sr_channel_group));
-		cg->name = g_strdup("Logic");
-		for (j = 0; j < num_logic_channels; j++) {
-			sprintf(channel_name, "D%d", j);
-			ch = sr_channel_new(sdi, j, SR_CHANNEL_LOGIC,
-						TRUE, channel_name);
-			cg->channels = g_slist_append(cg->channels, ch);
+	drvc = di->context;
+
+	conn = mock_file = NULL;
+	mock_rate = 0;
+	mock_latency = 0;
+	for (l = options; l; l = l->next) {
+		src = l->data;
+		switch (src->key) {
+		case SR_CONF_CONN:
+			conn = g_variant_get_string(src->data, NULL);
+			break;
+		case FX3_CONF_MOCK_FILE:
+			mock_file = g_variant_get_string(src->data, NULL);
+			break;
+		case FX3_CONF_MOCK_RATE:
+			mock_rate = g_variant_get_uint64(src->data);
+			break;
+		case FX3_CONF_MOCK_LATENCY:
+			mock_latency = g_variant_get_uint64(src->data);
+			break;
 		}
-		sdi->channel_groups = g_slist_append(NULL, cg);
-
-		for (j = 0; j < num_analog_channels; j++) {
-			snprintf(channel_name, 16, "A%d", j);
-			ch = sr_channel_new(sdi, j + num_logic_channels,
-					SR_CHANNEL_ANALOG, TRUE, channel_name);
-
-			/* Every analog channel gets its own channel group. */
-			cg = g_malloc0(sizeof(struct sr_channel_group));
-			cg->name = g_strdup(channel_name);
-			cg->channels = g_slist_append(NULL, ch);
-			sdi->channel_groups = g_slist_append(sdi->channel_groups, cg);
+	}
+	if (mock_file && *mock_file)
+		return scan_mock(di, cypress_fx3_mock_new(mock_file, mock_rate,
+			mock_latency));
+	if (conn)
+		conn_devices = sr_usb_find(drvc->sr_ctx->libusb_ctx, conn);
+	else
+		conn_devices = NULL;
+
+	/*
+	 * Find all cypress_fx3 compatible devices and upload firmware to
+	 * them, all boards at the same time. Watch for arrivals before any
+	 * upload starts.
+	 */
+	cypress_fx3_renum_wait_init(&renum, drvc->sr_ctx, is_plausible);
+	libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
+	if (conn && !conn_devices)
+		probes = NULL;
+	else
+		probes = probe_devices(drvc, devlist, conn_devices, TRUE);
+
+	num_uploaded = 0;
+	fw_updated = 0;
+	for (l = probes; l; l = l->next) {
+		probe = l->data;
+		if (!probe->fw_updated)
+			continue;
+		num_uploaded++;
+		fw_updated = MAX(fw_updated, probe->fw_updated);
+	}
+
+	if (num_uploaded) {
+		/*
+		 * One wait for all of them. The devices come back as
+		 * SuperSpeed devices under new addresses and possibly on
+		 * another bus. Probe the new ones in a fresh device list,
+		 * each takes the place of one of the uploads.
+		 */
+		if (cypress_fx3_renum_wait(&renum, num_uploaded,
+				fw_updated + MAX_RENUM_DELAY_MS * 1000) == SR_OK)
+			sr_dbg("%u device(s) re-enumerated after %" PRIi64 "ms.",
+				num_uploaded,
+				(g_get_monotonic_time() - fw_updated) / 1000);
+		libusb_free_device_list(devlist, 1);
+		libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
+		reprobes = probe_devices(drvc, devlist, NULL, FALSE);
+
+		m = reprobes;
+		for (l = probes; l; l = l->next) {
+			probe = l->data;
+			if (!probe->fw_updated)
+				continue;
+			while (m && !(((struct probe *)m->data)->has_firmware
+					&& cypress_fx3_renum_is_new(&renum,
+					((struct probe *)m->data)->dev)))
+				m = m->next;
+			if (!m)
+				/* Not back yet, dev_open() waits for it. */
+				continue;
+			back = m->data;
+			m = m->next;
+			reprobes = g_slist_remove(reprobes, back);
+			l->data = back;
+			probe_free(probe);
 		}
+		g_slist_free_full(reprobes, (GDestroyNotify)probe_free);
+	}
+	cypress_fx3_renum_wait_clear(&renum);
 
-		devc = cypress_fx3_dev_new();
-		devc->profile = prof;
-		sdi->priv = devc;
+	devices = NULL;
+	for (l = probes; l; l = l->next) {
+		probe = l->data;
+
+		sdi = dev_inst_new(probe->prof, probe->serial_num,
+			probe->connection_id);
+		devc = sdi->priv;
 		devices = g_slist_append(devices, sdi);
+		sdi->inst_type = SR_INST_USB;
 
-		devc->samplerates = samplerates;
-		devc->num_samplerates = ARRAY_SIZE(samplerates);
-		has_firmware = usb_match_manuf_prod(devlist[i],
-				"sigrok", "cypress-fx3");
-		if (has_firmware) {
+		if (probe->has_firmware) {
 			/* Already has the firmware, so fix the new address. */
 			sr_dbg("Found an Cypress FX3 device.");
 			sdi->status = SR_ST_INACTIVE;
-			sdi->inst_type = SR_INST_USB;
-			sdi->conn = sr_usb_dev_inst_new(libusb_get_bus_number(devlist[i]),
-					libusb_get_device_address(devlist[i]), NULL);
+			sdi->conn = sr_usb_dev_inst_new(libusb_get_bus_number(probe->dev),
+					libusb_get_device_address(probe->dev), NULL);
 		} else {
-			if (ezusb_upload_firmware_fx3(drvc->sr_ctx, devlist[i],
-					USB_CONFIGURATION, prof->firmware) == SR_OK) {
-				/* Store when this device's FW was updated. */
-				devc->fw_updated = g_get_monotonic_time();
-				/*Add delay for the device to re-enumerat in SuperSpeed*/
-				g_usleep(1000 * 1000);
-				devices = g_slist_remove(devices, sdi);
-				/* Rescan and refresh the device list. 
-				   This is needed as the device renumerates as a SuperSpeed device */
-				libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
-				/* Restart the iteration */
-				i = 0;
-				continue;
-			} else {
-				sr_err("Firmware upload failed for "
-				       "device %d.%d (logical), name %s.",
-				       libusb_get_bus_number(devlist[i]),
-				       libusb_get_device_address(devlist[i]),
-				       prof->firmware);
-			}
-			sdi->inst_type = SR_INST_USB;
-			sdi->conn = sr_usb_dev_inst_new(libusb_get_bus_number(devlist[i]),
+			devc->fw_updated = probe->fw_updated;
+			sdi->conn = sr_usb_dev_inst_new(libusb_get_bus_number(probe->dev),
 					0xff, NULL);
 		}
 	}
+	g_slist_free_full(probes, (GDestroyNotify)probe_free);
 	libusb_free_device_list(devlist, 1);
 	g_slist_free_full(conn_devices, (GDestroyNotify)sr_usb_dev_inst_free);
 
@@ -286,7 +712,12 @@ static GSList *scan(struct sr_dev_driver *di, GSList *options)
 
 static void clear_helper(struct dev_context *devc)
 {
+	cypress_fx3_free_buffers(devc);
+	cypress_fx3_mock_free(devc->mock);
 	g_slist_free(devc->enabled_analog_channels);
+	g_free(devc->spill_file);
+	g_free(devc->trace_file);
+	g_free(devc->cpus);
 }
 
 static int dev_clear(const struct sr_dev_driver *di)
@@ -297,39 +728,44 @@ static int dev_clear(const struct sr_dev_driver *di)
 static int dev_open(struct sr_dev_inst *sdi)
 {
 	struct sr_dev_driver *di = sdi->driver;
+	struct drv_context *drvc;
 	struct sr_usb_dev_inst *usb;
 	struct dev_context *devc;
+	struct renum_wait renum;
 	int ret;
-	int64_t timediff_us, timediff_ms;
 
 	devc = sdi->priv;
 	usb = sdi->conn;
 
+	if (devc->mock) {
+		if (cypress_fx3_dev_open(sdi, di) != SR_OK)
+			return SR_ERR;
+		if (devc->cur_samplerate == 0)
+			devc->cur_samplerate = devc->samplerates[0];
+		return SR_OK;
+	}
+
 	/*
 	 * If the firmware was recently uploaded, wait up to MAX_RENUM_DELAY_MS
 	 * milliseconds for the fx3 to renumerate.
 	 */
 	ret = SR_ERR;
-	
+
 	if (devc->fw_updated > 0) {
 		sr_info("Waiting for device to reset.");
-		/* Takes >= 300ms for the fx3 to be gone from the USB bus. */
-		g_usleep(300 * 1000);
-		timediff_ms = 0;
-		while (timediff_ms < MAX_RENUM_DELAY_MS) {
-			if ((ret = cypress_fx3_dev_open(sdi, di)) == SR_OK)
-				break;
-			g_usleep(100 * 1000);
-
-			timediff_us = g_get_monotonic_time() - devc->fw_updated;
-			timediff_ms = timediff_us / 1000;
-			sr_spew("Waited %" PRIi64 "ms.", timediff_ms);
-		}
+		drvc = di->context;
+		cypress_fx3_renum_wait_init(&renum, drvc->sr_ctx, is_plausible);
+		while ((ret = cypress_fx3_dev_open(sdi, di)) != SR_OK
+				&& cypress_fx3_renum_wait_step(&renum, devc->fw_updated
+				+ MAX_RENUM_DELAY_MS * 1000) == SR_OK)
+			;
+		cypress_fx3_renum_wait_clear(&renum);
 		if (ret != SR_OK) {
 			sr_err("Device failed to renumerate.");
 			return SR_ERR;
 		}
-		sr_info("Device came back after %" PRIi64 "ms.", timediff_ms);
+		sr_info("Device came back after %" PRIi64 "ms.",
+			(g_get_monotonic_time() - devc->fw_updated) / 1000);
 	} else {
 		sr_info("Firmware upload was not needed.");
 		ret = cypress_fx3_dev_open(sdi, di);
@@ -370,14 +806,30 @@ static int dev_open(struct sr_dev_inst *sdi)
 static int dev_close(struct sr_dev_inst *sdi)
 {
 	struct sr_usb_dev_inst *usb;
+	struct dev_context *devc;
 
 	usb = sdi->conn;
+	devc = sdi->priv;
+
+	if (devc->mock) {
+		cypress_fx3_drain_transfers(devc);
+		cypress_fx3_free_buffers(devc);
+		cypress_fx3_mock_close(devc->mock);
+		return SR_OK;
+	}
 
 	if (!usb->devhdl)
 		return SR_ERR_BUG;
 
 	sr_info("Closing device on %d.%d (logical) / %s (physical) interface %d.",
 		usb->bus, usb->address, sdi->connection_id, USB_INTERFACE);
+	/*
+	 * The pooled transfers are bound to this device handle. The ones
+	 * still in flight after stopping have to come back first.
+	 */
+	if (cypress_fx3_drain_transfers(devc) != SR_OK)
+		sr_warn("Transfers did not come back in time.");
+	cypress_fx3_free_buffers(devc);
 	libusb_release_interface(usb->devhdl, USB_INTERFACE);
 	libusb_close(usb->devhdl);
 	usb->devhdl = NULL;
@@ -385,6 +837,71 @@ static int dev_close(struct sr_dev_inst *sdi)
 	return SR_OK;
 }
 
+/* The counters are reset when an acquisition starts. */
+static GVariant *overflow_counters(const struct transfer_queue *q)
+{
+	GVariantBuilder b;
+
+	g_variant_builder_init(&b, G_VARIANT_TYPE("a{st}"));
+	g_variant_builder_add(&b, "{st}", "blocked", q->num_blocked);
+	g_variant_builder_add(&b, "{st}", "dropped-oldest",
+		q->num_dropped_oldest);
+	g_variant_builder_add(&b, "{st}", "dropped-newest",
+		q->num_dropped_newest);
+	g_variant_builder_add(&b, "{st}", "decimated", q->num_decimated);
+	g_variant_builder_add(&b, "{st}", "max-fill", (uint64_t)q->max_fill);
+	g_variant_builder_add(&b, "{st}", "pauses", q->num_pauses);
+	g_variant_builder_add(&b, "{st}", "resumes", q->num_resumes);
+
+	return g_variant_builder_end(&b);
+}
+
+static GVariant *mem_flags_get(unsigned int flags)
+{
+	GString *s;
+	unsigned int i;
+
+	s = g_string_new(NULL);
+	for (i = 0; i < ARRAY_SIZE(mem_flag_names); i++) {
+		if (!(flags & (1 << i)))
+			continue;
+		if (s->len)
+			g_string_append_c(s, ',');
+		g_string_append(s, mem_flag_names[i]);
+	}
+
+	return g_variant_new_take_string(g_string_free(s, FALSE));
+}
+
+/* A comma separated list of flag names, possibly empty. */
+static int mem_flags_set(GVariant *data, unsigned int *flags)
+{
+	char **names;
+	unsigned int i, j;
+	int ret;
+
+	*flags = 0;
+	ret = SR_OK;
+	names = g_strsplit(g_variant_get_string(data, NULL), ",", 0);
+	for (i = 0; names[i]; i++) {
+		if (!*g_strstrip(names[i]))
+			continue;
+		for (j = 0; j < ARRAY_SIZE(mem_flag_names); j++) {
+			if (!strcmp(names[i], mem_flag_names[j]))
+				break;
+		}
+		if (j == ARRAY_SIZE(mem_flag_names)) {
+			sr_err("Unknown memory option '%s'.", names[i]);
+			ret = SR_ERR_ARG;
+			break;
+		}
+		*flags |= 1 << j;
+	}
+	g_strfreev(names);
+
+	return ret;
+}
+
 static int config_get(uint32_t key, GVariant **data,
 	const struct sr_dev_inst *sdi, const struct sr_channel_group *cg)
 {
@@ -415,12 +932,68 @@ static int config_get(uint32_t key, GVariant **data,
 	case SR_CONF_LIMIT_SAMPLES:
 		*data = g_variant_new_uint64(devc->limit_samples);
 		break;
+	case SR_CONF_LIMIT_MSEC:
+		*data = g_variant_new_uint64(devc->limit_msec);
+		break;
+	case SR_CONF_CONTINUOUS:
+		*data = g_variant_new_boolean(devc->continuous);
+		break;
+	case FX3_CONF_RECORDER_WINDOW:
+		*data = g_variant_new_uint64(devc->recorder_msec);
+		break;
 	case SR_CONF_SAMPLERATE:
 		*data = g_variant_new_uint64(devc->cur_samplerate);
 		break;
 	case SR_CONF_CAPTURE_RATIO:
 		*data = g_variant_new_uint64(devc->capture_ratio);
 		break;
+	case FX3_CONF_QUEUE_DEPTH:
+		*data = g_variant_new_uint64(devc->queue_depth);
+		break;
+	case FX3_CONF_OVERFLOW_POLICY:
+		*data = g_variant_new_string(overflow_policies[devc->overflow_policy]);
+		break;
+	case FX3_CONF_OVERFLOW_COUNTERS:
+		*data = overflow_counters(&devc->queue);
+		break;
+	case FX3_CONF_ACQ_PROFILE:
+		*data = g_variant_new_string(acq_profile_names[devc->acq_profile]);
+		break;
+	case FX3_CONF_TRACE_FILE:
+		*data = g_variant_new_string(devc->trace_file ?
+			devc->trace_file : "");
+		break;
+	case FX3_CONF_CPUS:
+		*data = g_variant_new_string(devc->cpus ? devc->cpus : "");
+		break;
+	case FX3_CONF_NUMA_NODE:
+		*data = g_variant_new_int32(devc->numa_node);
+		break;
+	case FX3_CONF_RT_PRIORITY:
+		*data = g_variant_new_int32(devc->rt_priority);
+		break;
+	case FX3_CONF_MEMORY:
+		*data = mem_flags_get(devc->mem_flags);
+		break;
+	case SR_CONF_TRIGGER_SOURCE:
+		*data = g_variant_new_string(
+			trigger_sources[devc->analog_trigger.source + 1]);
+		break;
+	case SR_CONF_TRIGGER_SLOPE:
+		*data = g_variant_new_string(
+			trigger_slopes[devc->analog_trigger.slope]);
+		break;
+	case FX3_CONF_TRIGGER_BAND:
+		*data = std_gvar_tuple_double(devc->analog_trigger.low,
+			devc->analog_trigger.high);
+		break;
+	case FX3_CONF_SPILL_FILE:
+		*data = g_variant_new_string(devc->spill_file ?
+			devc->spill_file : "");
+		break;
+	case FX3_CONF_COMPRESS_MEMORY:
+		*data = g_variant_new_uint64(devc->compress_memory);
+		break;
 	default:
 		return SR_ERR_NA;
 	}
@@ -432,6 +1005,10 @@ static int config_set(uint32_t key, GVariant *data,
 	const struct sr_dev_inst *sdi, const struct sr_channel_group *cg)
 {
 	struct dev_context *devc;
+	uint64_t depth;
+	unsigned int flags;
+	double low, high;
+	const char *path;
 	int idx;
 
 	(void)cg;
@@ -453,9 +1030,94 @@ static int config_set(uint32_t key, GVariant *data,
 	case SR_CONF_LIMIT_SAMPLES:
 		devc->limit_samples = g_variant_get_uint64(data);
 		break;
+	case SR_CONF_LIMIT_MSEC:
+		devc->limit_msec = g_variant_get_uint64(data);
+		break;
+	case SR_CONF_CONTINUOUS:
+		devc->continuous = g_variant_get_boolean(data);
+		break;
+	case FX3_CONF_RECORDER_WINDOW:
+		devc->recorder_msec = g_variant_get_uint64(data);
+		break;
 	case SR_CONF_CAPTURE_RATIO:
 		devc->capture_ratio = g_variant_get_uint64(data);
 		break;
+	case FX3_CONF_QUEUE_DEPTH:
+		depth = g_variant_get_uint64(data);
+		if (depth < 1 || depth > MAX_QUEUE_DEPTH)
+			return SR_ERR_ARG;
+		devc->queue_depth = depth;
+		break;
+	case FX3_CONF_OVERFLOW_POLICY:
+		if ((idx = std_str_idx(data, ARRAY_AND_SIZE(overflow_policies))) < 0)
+			return SR_ERR_ARG;
+		devc->overflow_policy = idx;
+		break;
+	case FX3_CONF_ACQ_PROFILE:
+		if ((idx = std_str_idx(data, ARRAY_AND_SIZE(acq_profile_names))) < 0)
+			return SR_ERR_ARG;
+		devc->acq_profile = idx;
+		break;
+	case FX3_CONF_TRACE_FILE:
+		/* An empty name turns tracing off. */
+		path = g_variant_get_string(data, NULL);
+		g_free(devc->trace_file);
+		devc->trace_file = *path ? g_strdup(path) : NULL;
+		break;
+	case FX3_CONF_CPUS:
+		/* An empty list pins to no CPUs in particular. */
+		path = g_variant_get_string(data, NULL);
+		g_free(devc->cpus);
+		devc->cpus = *path ? g_strdup(path) : NULL;
+		break;
+	case FX3_CONF_NUMA_NODE:
+		if ((idx = g_variant_get_int32(data)) < -1)
+			return SR_ERR_ARG;
+		devc->numa_node = idx;
+		break;
+	case FX3_CONF_RT_PRIORITY:
+		if ((idx = g_variant_get_int32(data)) < 0)
+			return SR_ERR_ARG;
+		devc->rt_priority = idx;
+		break;
+	case FX3_CONF_MEMORY:
+		if (mem_flags_set(data, &flags) != SR_OK)
+			return SR_ERR_ARG;
+		devc->mem_flags = flags;
+		break;
+	case SR_CONF_TRIGGER_SOURCE:
+		if ((idx = std_str_idx(data, ARRAY_AND_SIZE(trigger_sources))) < 0)
+			return SR_ERR_ARG;
+		devc->analog_trigger.source = idx - 1;
+		break;
+	case SR_CONF_TRIGGER_SLOPE:
+		if ((idx = std_str_idx(data, ARRAY_AND_SIZE(trigger_slopes))) < 0)
+			return SR_ERR_ARG;
+		/* A window needs a band to be inside of. */
+		if (idx == ANALOG_TRIGGER_WINDOW && devc->analog_trigger.low
+				>= devc->analog_trigger.high)
+			return SR_ERR_ARG;
+		devc->analog_trigger.slope = idx;
+		break;
+	case FX3_CONF_TRIGGER_BAND:
+		g_variant_get(data, "(dd)", &low, &high);
+		if (low > high || (low == high && devc->analog_trigger.slope
+				== ANALOG_TRIGGER_WINDOW))
+			return SR_ERR_ARG;
+		devc->analog_trigger.low = low;
+		devc->analog_trigger.high = high;
+		break;
+	case FX3_CONF_SPILL_FILE:
+		/* An empty name turns deep capture off. */
+		path = g_variant_get_string(data, NULL);
+		g_free(devc->spill_file);
+		devc->spill_file = *path ? g_strdup(path) : NULL;
+		break;
+	case FX3_CONF_COMPRESS_MEMORY:
+		if (g_variant_get_uint64(data) > CSTORE_MEMORY_MAX)
+			return SR_ERR_ARG;
+		devc->compress_memory = g_variant_get_uint64(data);
+		break;
 	default:
 		return SR_ERR_NA;
 	}
@@ -484,6 +1146,22 @@ static int config_list(uint32_t key, GVariant **data,
 	case SR_CONF_TRIGGER_MATCH:
 		*data = std_gvar_array_i32(ARRAY_AND_SIZE(trigger_matches));
 		break;
+	case FX3_CONF_OVERFLOW_POLICY:
+		*data = g_variant_new_strv(ARRAY_AND_SIZE(overflow_policies));
+		break;
+	case FX3_CONF_ACQ_PROFILE:
+		*data = g_variant_new_strv(ARRAY_AND_SIZE(acq_profile_names));
+		break;
+	case SR_CONF_TRIGGER_SOURCE:
+		*data = g_variant_new_strv(ARRAY_AND_SIZE(trigger_sources));
+		break;
+	case SR_CONF_TRIGGER_SLOPE:
+		*data = g_variant_new_strv(ARRAY_AND_SIZE(trigger_slopes));
+		break;
+	case FX3_CONF_TRIGGER_BAND:
+		/* The parser scales the 8 bit samples to 0..3.3V. */
+		*data = std_gvar_min_max_step_thresholds(0.0, 3.3, 0.05);
+		break;
 	default:
 		return SR_ERR_NA;
 	}
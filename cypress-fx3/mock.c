@@ -0,0 +1,360 @@
+/*
+ * This file is part of the libsigrok project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stand-in for an FX3 board, so that the whole acquisition path can be
+ * run and timed without hardware. It answers the vendor commands and
+ * completes the bulk transfers with packets replayed from a capture in
+ * the test_packets_v2.bin format, looping over the file until the
+ * acquisition is stopped. Transfers which are not streamed to, because
+ * the device has not been started or is paused, time out like on the
+ * bus.
+ *
+ * The mock is enabled by the FX3_CONF_MOCK_FILE scan option, naming the
+ * capture file. The replay rate in bytes per second (unthrottled if 0)
+ * and the completion latency of every transfer in microseconds are set
+ * with FX3_CONF_MOCK_RATE and FX3_CONF_MOCK_LATENCY.
+ */
+
+#include <config.h>
+#include <glib.h>
+#include "protocol.h"
+
+#define MOCK_MAX_PENDING	(NUM_SIMUL_TRANSFERS + MAX_QUEUE_DEPTH)
+
+/* Smallest packet accepted by fx3driver_parse_next_packet(). */
+#define MIN_PACKET_SIZE		20
+
+struct mock_packet {
+	size_t offset;
+	size_t length;
+};
+
+struct mock_pending {
+	struct libusb_transfer *transfer;
+	int64_t submit_us;
+	int64_t ready_us;
+	gboolean scheduled;
+	gboolean cancelled;
+};
+
+struct cypress_fx3_mock {
+	char *path;
+	uint64_t rate;
+	int64_t latency_us;
+
+	uint8_t *data;
+	struct mock_packet *packets;
+	size_t num_packets;
+	size_t next_packet;
+
+	gboolean running;
+	gboolean paused;
+	/* When the simulated bus is done with the last scheduled transfer. */
+	int64_t bus_free_us;
+
+	/* Submitted transfers, in submission order. */
+	struct mock_pending pending[MOCK_MAX_PENDING];
+	unsigned int num_pending;
+
+	int64_t start_us;
+	uint64_t num_bytes;
+	uint64_t num_transfers;
+};
+
+SR_PRIV struct cypress_fx3_mock *cypress_fx3_mock_new(const char *path,
+	uint64_t rate, int64_t latency_us)
+{
+	struct cypress_fx3_mock *mock;
+
+	mock = g_malloc0(sizeof(*mock));
+	mock->path = g_strdup(path);
+	mock->rate = rate;
+	mock->latency_us = latency_us;
+
+	return mock;
+}
+
+SR_PRIV void cypress_fx3_mock_free(struct cypress_fx3_mock *mock)
+{
+	if (!mock)
+		return;
+
+	cypress_fx3_mock_close(mock);
+	g_free(mock->path);
+	g_free(mock);
+}
+
+static size_t packet_length(const uint8_t *p, size_t avail)
+{
+	uint8_t type;
+	size_t length;
+
+	if (avail < MIN_PACKET_SIZE || RB16(p) != PREAMBLE)
+		return 0;
+
+	type = p[2];
+	length = RB16(p + 8);
+	if ((type != 0x00 && type != 0xFF) || length < MIN_PACKET_SIZE
+			|| length > MAX_PACKET_SIZE || length > avail)
+		return 0;
+	if (RB16(p + 10) != 0xF1F1 || RB16(p + 12) != 0xF2F2
+			|| RB16(p + 14) != 0xF3F3)
+		return 0;
+
+	return length;
+}
+
+/* Load the capture and index its packets, garbage in between is skipped. */
+SR_PRIV int cypress_fx3_mock_open(struct cypress_fx3_mock *mock)
+{
+	GError *error;
+	gchar *contents;
+	gsize size, offset, length, n;
+
+	error = NULL;
+	if (!g_file_get_contents(mock->path, &contents, &size, &error)) {
+		sr_err("Failed to load mock capture: %s.", error->message);
+		g_error_free(error);
+		return SR_ERR;
+	}
+	mock->data = (uint8_t *)contents;
+
+	n = 0;
+	for (offset = 0; offset < size; offset++) {
+		if ((length = packet_length(mock->data + offset, size - offset))) {
+			n++;
+			offset += length - 1;
+		}
+	}
+	if (!n) {
+		sr_err("No packets in mock capture %s.", mock->path);
+		cypress_fx3_mock_close(mock);
+		return SR_ERR;
+	}
+
+	mock->packets = g_malloc(n * sizeof(*mock->packets));
+	mock->num_packets = 0;
+	for (offset = 0; offset < size; offset++) {
+		if ((length = packet_length(mock->data + offset, size - offset))) {
+			mock->packets[mock->num_packets].offset = offset;
+			mock->packets[mock->num_packets].length = length;
+			mock->num_packets++;
+			offset += length - 1;
+		}
+	}
+
+	sr_info("Mock device replays %zu packets from %s at %" PRIu64
+		" bytes/s, %" PRIi64 "us completion latency.", mock->num_packets,
+		mock->path, mock->rate, mock->latency_us);
+
+	return SR_OK;
+}
+
+SR_PRIV void cypress_fx3_mock_close(struct cypress_fx3_mock *mock)
+{
+	g_free(mock->packets);
+	mock->packets = NULL;
+	mock->num_packets = 0;
+	g_free(mock->data);
+	mock->data = NULL;
+	mock->running = FALSE;
+	mock->num_pending = 0;
+}
+
+/*
+ * Fill the transfer with whole packets and work out when it completes.
+ * The simulated bus streams one transfer after the other at the replay
+ * rate, each completion is delayed by the configured latency.
+ */
+static void schedule(struct cypress_fx3_mock *mock, struct mock_pending *p,
+	int64_t now)
+{
+	struct libusb_transfer *transfer;
+	const struct mock_packet *pkt;
+	int64_t start_us;
+	int length;
+
+	transfer = p->transfer;
+	length = 0;
+	while (1) {
+		pkt = &mock->packets[mock->next_packet];
+		if (length + pkt->length > (size_t)transfer->length)
+			break;
+		memcpy(transfer->buffer + length, mock->data + pkt->offset,
+			pkt->length);
+		length += pkt->length;
+		mock->next_packet = (mock->next_packet + 1) % mock->num_packets;
+	}
+	transfer->actual_length = length;
+
+	start_us = MAX(now, mock->bus_free_us);
+	mock->bus_free_us = start_us;
+	if (mock->rate)
+		mock->bus_free_us += (uint64_t)length * 1000000 / mock->rate;
+	p->ready_us = mock->bus_free_us + mock->latency_us;
+	p->scheduled = TRUE;
+}
+
+SR_PRIV int cypress_fx3_mock_control(struct cypress_fx3_mock *mock,
+	uint8_t request, uint8_t *data, uint16_t length)
+{
+	struct version_info *vi;
+	unsigned int i;
+	int64_t now;
+
+	switch (request) {
+	case CMD_GET_FW_VERSION:
+		if (length < sizeof(*vi))
+			return LIBUSB_ERROR_OVERFLOW;
+		vi = (struct version_info *)data;
+		vi->major = FX3_REQUIRED_VERSION_MAJOR;
+		vi->minor = 0;
+		return sizeof(*vi);
+	case CMD_GET_REVID_VERSION:
+		if (length < 1)
+			return LIBUSB_ERROR_OVERFLOW;
+		data[0] = 0;
+		return 1;
+	case CMD_START:
+		if (!mock->data)
+			return LIBUSB_ERROR_NO_DEVICE;
+		now = g_get_monotonic_time();
+		mock->running = TRUE;
+		mock->paused = FALSE;
+		mock->next_packet = 0;
+		mock->bus_free_us = now;
+		mock->start_us = now;
+		mock->num_bytes = mock->num_transfers = 0;
+		for (i = 0; i < mock->num_pending; i++)
+			schedule(mock, &mock->pending[i], now);
+		return length;
+	case CMD_PAUSE:
+		/* Transfers already scheduled are on the wire, they complete. */
+		mock->paused = TRUE;
+		return 0;
+	case CMD_RESUME:
+		if (!mock->paused)
+			return 0;
+		mock->paused = FALSE;
+		now = g_get_monotonic_time();
+		for (i = 0; i < mock->num_pending; i++) {
+			if (!mock->pending[i].scheduled)
+				schedule(mock, &mock->pending[i], now);
+		}
+		return 0;
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+}
+
+SR_PRIV void cypress_fx3_mock_stop(struct cypress_fx3_mock *mock)
+{
+	int64_t elapsed_us;
+
+	if (!mock->running)
+		return;
+	mock->running = FALSE;
+
+	elapsed_us = g_get_monotonic_time() - mock->start_us;
+	sr_info("Mock device delivered %" PRIu64 " bytes in %" PRIu64
+		" transfers within %" PRIi64 "ms (%.1f MB/s).", mock->num_bytes,
+		mock->num_transfers, elapsed_us / 1000, elapsed_us ?
+		(double)mock->num_bytes / elapsed_us : 0.0);
+}
+
+SR_PRIV int cypress_fx3_mock_submit_transfer(struct cypress_fx3_mock *mock,
+	struct libusb_transfer *transfer)
+{
+	struct mock_pending *p;
+
+	if (!mock->data)
+		return LIBUSB_ERROR_NO_DEVICE;
+	if (mock->num_pending == MOCK_MAX_PENDING)
+		return LIBUSB_ERROR_BUSY;
+
+	p = &mock->pending[mock->num_pending++];
+	p->transfer = transfer;
+	p->submit_us = g_get_monotonic_time();
+	p->scheduled = p->cancelled = FALSE;
+	if (mock->running && !mock->paused)
+		schedule(mock, p, p->submit_us);
+
+	return LIBUSB_SUCCESS;
+}
+
+SR_PRIV int cypress_fx3_mock_cancel_transfer(struct cypress_fx3_mock *mock,
+	struct libusb_transfer *transfer)
+{
+	unsigned int i;
+
+	for (i = 0; i < mock->num_pending; i++) {
+		if (mock->pending[i].transfer == transfer) {
+			mock->pending[i].cancelled = TRUE;
+			return LIBUSB_SUCCESS;
+		}
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* Nothing streams into a transfer which is not scheduled. */
+static gboolean timed_out(const struct mock_pending *p, int64_t now)
+{
+	return !p->scheduled && p->transfer->timeout
+		&& now - p->submit_us >= (int64_t)p->transfer->timeout * 1000;
+}
+
+/*
+ * Complete the transfers which are due, like libusb_handle_events() does
+ * for a real device. The callbacks may submit again, so the completed
+ * transfers are taken off the pending list before any of them runs.
+ */
+SR_PRIV void cypress_fx3_mock_handle_events(struct cypress_fx3_mock *mock)
+{
+	struct libusb_transfer *done[MOCK_MAX_PENDING];
+	struct mock_pending *p;
+	unsigned int i, n, num_done;
+	int64_t now;
+
+	now = g_get_monotonic_time();
+	num_done = n = 0;
+	for (i = 0; i < mock->num_pending; i++) {
+		p = &mock->pending[i];
+		if (p->cancelled) {
+			p->transfer->status = LIBUSB_TRANSFER_CANCELLED;
+			p->transfer->actual_length = 0;
+		} else if (p->scheduled && p->ready_us <= now) {
+			p->transfer->status = LIBUSB_TRANSFER_COMPLETED;
+			mock->num_bytes += p->transfer->actual_length;
+			mock->num_transfers++;
+		} else if (timed_out(p, now)) {
+			p->transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+			p->transfer->actual_length = 0;
+		} else {
+			mock->pending[n++] = *p;
+			continue;
+		}
+		done[num_done++] = p->transfer;
+	}
+	mock->num_pending = n;
+
+	for (i = 0; i < num_done; i++)
+		done[i]->callback(done[i]);
+}
@@ -17,275 +17,495 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
 #include <config.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include "protocol.h"
 
+#include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 
-#pragma pack(push, 1)
-
-struct version_info {
-	uint8_t major;
-	uint8_t minor;
-};
-
-struct cmd_start_acquisition {
-	uint16_t sampling_factor;
-};
-
-#pragma pack(pop)
-
 #define USB_TIMEOUT 100
 
+/*
+ * Transfer geometry and batching of the acquisition profiles, in
+ * enum acq_profile order. A flush deadline of 0 means transfers only
+ * come back once they are full. The emit limits are those of the analog
+ * and logic emitters, see struct sample_emitter.
+ */
+static const struct {
+	unsigned int buffer_ms;
+	unsigned int in_flight_ms;
+	unsigned int flush_ms;
+	unsigned int drain_budget_ms;
+	unsigned int emit_analog;
+	unsigned int emit_logic;
+	unsigned int emit_ms;
+} acq_profiles[] = {
+	/* Large transfers, queued transfers are parsed in batches. */
+	[PROFILE_THROUGHPUT] = { 10, 500, 0, 20, 4096, 65536, 100 },
+	/* Small transfers, flushed early and parsed right away. */
+	[PROFILE_LATENCY] = { 1, 20, 5, 2, 64, 512, 5 },
+};
 
-#define PREAMBLE 0xABCD    
-#define HEADER_SIZE 16       // Up to start of Sample[0]
-#define MAX_PACKET_SIZE 1024 
-#define MAX_SAFE_SAMPLES 10  // Only up to 10 samples
-
-// static uint16_t read_uint16_le(const uint8_t *buf) {
-//     return (buf[1] << 8) | buf[0];
-// }
-
-static inline uint16_t read_uint16_be(const uint8_t *buf) {
-    return (buf[0] << 8) | buf[1];
+static inline uint16_t read_uint16_be(const uint8_t *buf)
+{
+	return (buf[0] << 8) | buf[1];
 }
 
+/*
+ * Big endian 16 bit words to host order samples, eight at a time where
+ * the compiler has vector extensions.
+ */
+static void decode_logic_samples(const uint8_t *in, uint16_t *out,
+	size_t num_samples)
+{
+	size_t i;
 
-static struct parsed_packet parsed_pkt;
-
+	i = 0;
+#if defined(__GNUC__) && G_BYTE_ORDER == G_LITTLE_ENDIAN
+	typedef uint16_t v8u16 __attribute__((vector_size(16)));
+	v8u16 v;
 
-static uint16_t calculate_checksum(const uint8_t *data, size_t length) {
-    uint16_t sum = 0;
-    for (size_t i = 0; i < length; i++) {
-        sum += data[i];
-    }
-    return sum & 0xFFFF;
+	for (; i + 8 <= num_samples; i += 8) {
+		memcpy(&v, in + 2 * i, sizeof(v));
+		v = (v << 8) | (v >> 8);
+		memcpy(out + i, &v, sizeof(v));
+	}
+#endif
+	for (; i < num_samples; i++)
+		out[i] = read_uint16_be(in + 2 * i);
 }
 
-int fx3driver_parse_next_packet(const uint8_t *data, size_t len, struct parsed_packet *pkt)
+/* Mark pkt as rejected and skip past its preamble. */
+static int reject_packet(struct parsed_packet *pkt)
 {
+	pkt->channel_type = PACKET_TYPE_REJECTED;
+	pkt->num_samples = 0;
+	pkt->analog_samples = NULL;
+	pkt->digital_samples = NULL;
 
-	// Display raw data
-    // for (int i=0;i<len;i++) {
-	// 	printf("%02X ", data[i]);
-	// 	if (i % 30 == 0) {
-	// 		printf("\n");
-		
-	// 	}
-	// }
-
-	// return 0;
-	sr_err("Entered fx3driver_parse_next_packet (len=%zu)", len);
-	//sr_err("Entered fx3driver_parse_next_packet (len=0x%zx)", len);
-
+	return 2;
+}
 
+/*
+ * The analog values are stored to analog_values, which has room for
+ * ANALOG_PACKET_VALUES and is reused for every packet. The samples of a
+ * digital packet are stored to digital_values, which has room for
+ * LOGIC_PACKET_SAMPLES.
+ */
+int fx3driver_parse_next_packet(const uint8_t *data, size_t len,
+	struct parsed_packet *pkt, float *analog_values,
+	uint16_t *digital_values)
+{
+	const uint8_t *pkt_data;
+	uint16_t channel_field, packet_length;
+	size_t offset, sample_data_len, num_samples, ch, s;
 
-	if (!data || !pkt)
-    return 0;
+	if (!data || !pkt || !analog_values || !digital_values)
+		return 0;
 
 	memset(pkt, 0, sizeof(*pkt));
 
-
-
-	size_t offset = 0;
+	offset = 0;
 	while (offset + 20 <= len) {
 		if (read_uint16_be(&data[offset]) == 0xABCD) {
-			sr_err("Dumping 16 words after preamble at offset %zu", offset);
-			for (size_t i = 0; i < 16; i++) {
-				uint16_t word = read_uint16_be(&data[offset + 2 + i * 2]);
-				sr_err("Word[%zu] = 0x%04X", i, word);
-			}
-
-			uint16_t ch_field = read_uint16_be(&data[offset + 2]);
-			uint8_t ch_type = ch_field >> 8;
+			uint8_t ch_type = data[offset + 2];
 			uint16_t length = read_uint16_be(&data[offset + 8]);
-			uint16_t res1 = read_uint16_be(&data[offset + 10]);
-			uint16_t res2 = read_uint16_be(&data[offset + 12]);
-			uint16_t res3 = read_uint16_be(&data[offset + 14]);
-
 
-			sr_err("Candidate offset %zu: ch=0x%04X type=0x%02X len=0x%04X res1=0x%04X res2=0x%04X res3=0x%04X",
-				offset, ch_field, ch_type, length, res1, res2, res3);
-
-			if ((ch_type == 0x00 || ch_type == 0xFF) &&
-				(length >= 20 && length <= MAX_PACKET_SIZE) &&
-				res1 == 0xF1F1 &&
-				res2 == 0xF2F2 &&
-				res3 == 0xF3F3) {
-				sr_err("Valid preamble+header at offset %zu", offset);
+			if ((ch_type == 0x00 || ch_type == 0xFF)
+					&& length >= 20 && length <= MAX_PACKET_SIZE
+					&& read_uint16_be(&data[offset + 10]) == 0xF1F1
+					&& read_uint16_be(&data[offset + 12]) == 0xF2F2
+					&& read_uint16_be(&data[offset + 14]) == 0xF3F3)
 				break;
-			} else {
-				sr_err("Skipping candidate at offset %zu due to invalid header", offset);
-			}
+			sr_dbg("Skipping candidate at offset %zu due to invalid header", offset);
 		}
 		offset++;
 	}
 
+	pkt_data = &data[offset + 2];
 
-
-    const uint8_t *pkt_data = &data[offset + 2];
-
-	uint16_t channel_field = read_uint16_be(&pkt_data[0]);
-	pkt->channel_type = (channel_field >> 8);
-	sr_err("Channel type: 0x%04X", pkt->channel_type);
-
+	channel_field = read_uint16_be(&pkt_data[0]);
+	pkt->channel_type = channel_field >> 8;
 	pkt->channel_number = channel_field & 0xFF;
-	sr_err("Channel number: 0x%04X", pkt->channel_number);
-
-	uint16_t ts_lo = read_uint16_be(&pkt_data[2]);
-	sr_err("ts_lo: 0x%04X", ts_lo);
+	pkt->ts_lo = read_uint16_be(&pkt_data[2]);
+	pkt->ts_hi = read_uint16_be(&pkt_data[4]);
 
-	uint16_t ts_hi = read_uint16_be(&pkt_data[4]);
-	sr_err("ts_hi: 0x%04X", ts_hi);
-
-
-	pkt->ts_lo = ts_lo;
-	pkt->ts_hi = ts_hi;
-
-	uint16_t packet_length = read_uint16_be(&pkt_data[6]);
+	packet_length = read_uint16_be(&pkt_data[6]);
 	if (packet_length < 20 || len - offset < packet_length) {
 		sr_err("Invalid packet length: 0x%02X", packet_length);
-		return 2;
+		return reject_packet(pkt);
 	}
 
 	if (read_uint16_be(&pkt_data[8]) != 0xF1F1 ||
 		read_uint16_be(&pkt_data[10]) != 0xF2F2 ||
 		read_uint16_be(&pkt_data[12]) != 0xF3F3) {
 		sr_err("Reserved fields mismatch");
-		return 2;
+		return reject_packet(pkt);
 	}
 
-    size_t sample_data_len = packet_length - 18;  // subtract header + checksum   use 18 if checksum enabled in packet and if not use 16
-    //size_t num_samples = sample_data_len / 2; for digital
-	size_t num_samples = sample_data_len ;
-    if (num_samples == 0 || num_samples > 16) {
-        
-		sr_err("Invalid sample count: 0x%zx", num_samples);
+	/* Header and checksum take 18 bytes. */
+	sample_data_len = packet_length - 18;
 
-        return 2;
-    }
+	if (pkt->channel_type == 0xFF) {
+		/* One 16 bit word per sample, D0 in the least significant bit. */
+		pkt->num_samples = sample_data_len / 2;
+		pkt->digital_samples = digital_values;
+		decode_logic_samples(&pkt_data[14], digital_values,
+			pkt->num_samples);
+		return offset + packet_length;
+	}
 
-    pkt->num_samples = 2;
-	pkt->analog_samples = g_malloc0(num_samples * sizeof(float));
+	num_samples = sample_data_len;
+	if (num_samples == 0 || num_samples > 16) {
+		sr_err("Invalid sample count: 0x%zx", num_samples);
+		return reject_packet(pkt);
+	}
 
-    //pkt->digital_samples = g_malloc0(num_samples);
-    
-	if (!pkt->analog_samples) {
-        sr_err("Memory allocation failed");
-        return 2;
-    }
+	pkt->num_samples = ANALOG_PACKET_SAMPLES;
+	/* Every value is written below. */
+	pkt->analog_samples = analog_values;
 
+	/* Channel after channel in the packet, interleaved per sample out. */
+	for (ch = 0; ch < ANALOG_PACKET_CHANNELS; ch++) {
+		for (s = 0; s < ANALOG_PACKET_SAMPLES; s++) {
+			uint8_t raw = pkt_data[14 + ch * ANALOG_PACKET_SAMPLES + s];
+			pkt->analog_samples[s * ANALOG_PACKET_CHANNELS + ch] =
+				(raw / 255.0f) * 3.3f;
+		}
+	}
 
-	// Get the analog samples and print their values in Volts
-	// for (size_t i = 0; i < num_samples; i++) {
-	// 	uint8_t raw = pkt_data[14 + i];
+	return offset + packet_length;
+}
 
-	// 	// Convert to voltage
-	// 	float voltage = (raw / 255.0f) * 3.3f;
+static int command_get_fw_version(const struct sr_dev_inst *sdi,
+				  struct version_info *vi)
+{
+	struct dev_context *devc = sdi->priv;
+	struct sr_usb_dev_inst *usb = sdi->conn;
+	int ret;
 
-	// 	// Store as float in volts
-	// 	pkt->analog_samples[i] = voltage;
+	if (devc->mock)
+		ret = cypress_fx3_mock_control(devc->mock, CMD_GET_FW_VERSION,
+			(uint8_t *)vi, sizeof(struct version_info));
+	else
+		ret = libusb_control_transfer(usb->devhdl,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN,
+			CMD_GET_FW_VERSION, 0x0000, 0x0000, (unsigned char *)vi,
+			sizeof(struct version_info), USB_TIMEOUT);
 
-	// 	// Print the analog voltage
-	// 	sr_err("Sample[%zu]: Analog voltage = %.3f V", i, voltage);
-	// }
+	if (ret < 0) {
+		sr_err("Unable to get version info: %s.",
+		       libusb_error_name(ret));
+		return SR_ERR;
+	}
 
+	return SR_OK;
+}
 
-	// //Get the bits from hex values for channels
-	// for (size_t i = 0; i < num_samples; i++) {
-    // //uint8_t raw = read_uint16_be(&pkt_data[14 + i * 2]); // start getting samples
-	// int8_t raw = pkt_data[14 + i];
-	// float voltage = (raw / 255.0f) * 3.3f;
+static int command_get_revid_version(const struct sr_dev_inst *sdi,
+	uint8_t *revid)
+{
+	struct dev_context *devc = sdi->priv;
+	struct sr_usb_dev_inst *usb = sdi->conn;
+	int ret;
 
-    // // Optionally print each bit of the samples 
-    // 	for (int ch = 0; ch < 8; ch++) {
-	// 		uint8_t bit = (raw >> ch) & 1;
-   	// 	}
-	
-   	// pkt->analog_samples[i] = voltage;
-    // sr_err("Sample[%zu]: Analog voltage = %.3f V", i, voltage);
-    
-	// }
+	if (devc->mock)
+		ret = cypress_fx3_mock_control(devc->mock,
+			CMD_GET_REVID_VERSION, revid, 1);
+	else
+		ret = libusb_control_transfer(usb->devhdl,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN,
+			CMD_GET_REVID_VERSION, 0x0000, 0x0000, revid, 1,
+			USB_TIMEOUT);
 
+	if (ret < 0) {
+		sr_err("Unable to get REVID: %s.", libusb_error_name(ret));
+		return SR_ERR;
+	}
 
-	size_t sample_data_offset = 14;
-	size_t num_samples_per_channel = 2;
-	size_t num_channels = 8;
-	//pkt->num_analog_channels = num_channels;
+	return SR_OK;
+}
 
+static int command_start_acquisition(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
+	uint64_t samplerate;
+	struct cmd_start_acquisition cmd;
+	int ret;
 
-	for (size_t ch = 0; ch < num_channels; ch++) {
-		for (size_t s = 0; s < num_samples_per_channel; s++) {
-			size_t index = sample_data_offset + (ch * num_samples_per_channel) + s;
+	devc = sdi->priv;
+	usb = sdi->conn;
+	samplerate = devc->cur_samplerate;
 
-			uint8_t raw = pkt_data[index];
-			float voltage = (raw / 255.0f) * 3.3f;
+	/* Compute the sample rate. */
+	if (devc->sample_wide && samplerate > MAX_16BIT_SAMPLE_RATE) {
+		sr_err("Unable to sample at %" PRIu64 "Hz "
+		       "when collecting 16-bit samples.", samplerate);
+		return SR_ERR;
+	}
 
-			// Store in a linear array, e.g.:
-			pkt->analog_samples[s * num_channels + ch] = voltage;
+	cmd.sampling_factor = (FX3_PIB_CLOCK)/(samplerate);
+	
+	sr_spew("cmd.sampling_factor = %d",cmd.sampling_factor);
 
-			sr_err("Sample[%zu] Channel[%zu]: %.3f V", s, ch, voltage);
-		}
+	/* Send the control message. */
+	if (devc->mock)
+		ret = cypress_fx3_mock_control(devc->mock, CMD_START,
+			(uint8_t *)&cmd, sizeof(cmd));
+	else
+		ret = libusb_control_transfer(usb->devhdl,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+			CMD_START, 0x0000, 0x0000, (unsigned char *)&cmd,
+			sizeof(cmd), USB_TIMEOUT);
+	if (ret < 0) {
+		sr_err("Unable to send start command: %s.",
+		       libusb_error_name(ret));
+		return SR_ERR;
+	}else{
+		sr_info("CMD_START vendor command sent successfully");
 	}
 
+	return SR_OK;
+}
+
+/*
+ * Devices of this driver which were opened for the same session acquire
+ * as a sync group. Each member joins when its acquisition starts; a group
+ * is only formed with more than one member. Members still send their own
+ * datafeeds: the group only aligns them to a common start and keeps them
+ * within SYNC_MAX_SKEW_US of each other, it does not merge them.
+ */
+static void sync_group_join(const struct sr_dev_inst *sdi)
+{
+	struct drv_context *drvc;
+	struct dev_context *devc, *other_devc;
+	struct sr_dev_inst *other;
+	struct sync_group *group;
+	unsigned int num_members;
+	GSList *l;
 
+	devc = sdi->priv;
+	drvc = sdi->driver->context;
+
+	group = NULL;
+	num_members = 0;
+	for (l = drvc->instances; l; l = l->next) {
+		other = l->data;
+		if (other->session != sdi->session
+				|| other->status != SR_ST_ACTIVE)
+			continue;
+		num_members++;
+		other_devc = other->priv;
+		if (other != sdi && other_devc->sync_group
+				&& !other_devc->sync_group->cancelled)
+			group = other_devc->sync_group;
+	}
 
+	devc->sync_group = NULL;
+	devc->sync_aligned = TRUE;
+	devc->sync_sent = 0;
+	if (num_members < 2)
+		return;
 
-    sr_err("Analog packet parsed successfully");
-    return offset + packet_length;
+	if (!group) {
+		group = g_malloc0(sizeof(struct sync_group));
+		group->num_members = num_members;
+	}
+	group->members = g_slist_append(group->members, (void *)sdi);
+	devc->sync_group = group;
+	devc->sync_aligned = FALSE;
 }
 
+/*
+ * A member leaving before the group started, e.g. because it failed to
+ * start, cancels the group: the others would wait for it forever, so they
+ * are stopped as well. The group is gone once the last member left.
+ */
+static void sync_group_leave(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc, *member_devc;
+	struct sync_group *group;
+	struct sr_dev_inst *member;
+	GSList *members, *l;
+
+	devc = sdi->priv;
+	if (!(group = devc->sync_group))
+		return;
 
+	devc->sync_group = NULL;
+	group->members = g_slist_remove(group->members, sdi);
+
+	if (!group->started && !group->cancelled) {
+		sr_warn("Sync group cancelled, %s did not start.",
+			sdi->connection_id);
+		group->cancelled = TRUE;
+		/* Aborting may leave the group right away, keep it until done. */
+		group->cancelling = TRUE;
+		members = g_slist_copy(group->members);
+		for (l = members; l; l = l->next) {
+			member = l->data;
+			member_devc = member->priv;
+			if (!member_devc->acq_aborted)
+				cypress_fx3_abort_acquisition(member_devc);
+		}
+		g_slist_free(members);
+		group->cancelling = FALSE;
+	}
 
+	if (!group->members && !group->cancelling)
+		g_free(group);
+}
 
+/*
+ * Send CMD_START, to the whole sync group once its last member is ready.
+ * The midpoint of every control transfer estimates when that device
+ * started counting, the latest of them is the common start.
+ */
+static int sync_group_start(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc, *member_devc;
+	struct sync_group *group;
+	struct sr_dev_inst *member;
+	int64_t before_us, first_us;
+	GSList *l;
+	int ret;
 
-static void print_hex_debug_reversed(const uint8_t *buf, size_t len) {
-    char line[128];
+	devc = sdi->priv;
+	if (!(group = devc->sync_group))
+		return command_start_acquisition(sdi);
+	if (group->cancelled)
+		return SR_ERR;
 
-    for (ssize_t i = len - 1; i >= 0; i -= 16) {
-        int n = snprintf(line, sizeof(line), "%04zx: ", (size_t)i);
+	if (++group->num_ready < group->num_members) {
+		sr_dbg("Waiting for %u more device(s) of the sync group.",
+		       group->num_members - group->num_ready);
+		return SR_OK;
+	}
 
-        // j counts down from i to i - 15, but stops at 0
-        for (ssize_t j = 0; j < 16 && (i - j) >= 0; j++) {
-            n += snprintf(line + n, sizeof(line) - n, "%02X ", buf[i - j]);
-        }
+	first_us = group->start_us = 0;
+	for (l = group->members; l; l = l->next) {
+		member = l->data;
+		member_devc = member->priv;
+		before_us = g_get_monotonic_time();
+		if ((ret = command_start_acquisition(member)) != SR_OK)
+			return ret;
+		member_devc->sync_offset_us =
+			(before_us + g_get_monotonic_time()) / 2;
+		if (!first_us)
+			first_us = member_devc->sync_offset_us;
+		group->start_us = MAX(group->start_us,
+			member_devc->sync_offset_us);
+	}
+	group->started = TRUE;
+
+	for (l = group->members; l; l = l->next) {
+		member = l->data;
+		member_devc = member->priv;
+		sr_info("Sync group: %s started %" PRIi64 "us after the "
+			"first device.", member->connection_id,
+			member_devc->sync_offset_us - first_us);
+	}
 
-        sr_err("%s", line);
-    }
+	return SR_OK;
 }
 
+/*
+ * Number of leading samples of the packet from before the common start
+ * of the sync group. Packet timestamps count sample periods since the
+ * device started.
+ */
+static size_t sync_skip(struct dev_context *devc,
+	const struct parsed_packet *pkt)
+{
+	uint64_t ts;
+	int64_t pkt_us;
+	size_t skip;
+
+	if (G_LIKELY(devc->sync_aligned))
+		return 0;
+
+	ts = ((uint32_t)pkt->ts_hi << 16) | pkt->ts_lo;
+	pkt_us = devc->sync_offset_us + ts * 1000000 / devc->cur_samplerate;
+	if (pkt_us >= devc->sync_group->start_us) {
+		devc->sync_aligned = TRUE;
+		return 0;
+	}
 
+	skip = ((devc->sync_group->start_us - pkt_us) * devc->cur_samplerate
+		+ 999999) / 1000000;
+	if (skip < pkt->num_samples)
+		devc->sync_aligned = TRUE;
 
-static void print_hex_debug(const uint8_t *buf, size_t len) {
-    char line[128];
-    for (size_t i = 0; i < len; i += 16) {
-        int n = snprintf(line, sizeof(line), "%04zx: ", i);
-        for (size_t j = 0; j < 16 && i + j < len; j++) {
-            n += snprintf(line + n, sizeof(line) - n, "%02X ", buf[i + j]);
-        }
-        sr_err("%s", line);
-    }
+	return MIN(skip, pkt->num_samples);
 }
 
+/*
+ * Is this member ahead of the slowest running member of its sync group
+ * by more than SYNC_MAX_SKEW_US? It then holds its data back, so that
+ * the datafeeds of the group stay in step.
+ */
+static gboolean sync_ahead(const struct dev_context *devc)
+{
+	const struct dev_context *member_devc;
+	const struct sr_dev_inst *member;
+	int64_t own_us, member_us;
+	GSList *l;
+
+	if (G_LIKELY(!devc->sync_group))
+		return FALSE;
+
+	own_us = devc->sync_sent * 1000000 / devc->cur_samplerate;
+	for (l = devc->sync_group->members; l; l = l->next) {
+		member = l->data;
+		member_devc = member->priv;
+		if (member_devc == devc || member_devc->acq_aborted)
+			continue;
+		member_us = member_devc->sync_sent * 1000000
+			/ member_devc->cur_samplerate;
+		if (own_us > member_us + SYNC_MAX_SKEW_US)
+			return TRUE;
+	}
 
+	return FALSE;
+}
 
-
-static int command_get_fw_version(libusb_device_handle *devhdl,
-				  struct version_info *vi)
+/* Send CMD_PAUSE or CMD_RESUME. */
+static int command_flow_control(const struct sr_dev_inst *sdi, uint8_t cmd)
 {
+	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
 	int ret;
 
-	ret = libusb_control_transfer(devhdl, LIBUSB_REQUEST_TYPE_VENDOR |
-		LIBUSB_ENDPOINT_IN, CMD_GET_FW_VERSION, 0x0000, 0x0000,
-		(unsigned char *)vi, sizeof(struct version_info), USB_TIMEOUT);
+	devc = sdi->priv;
+	usb = sdi->conn;
 
+	if (devc->mock)
+		ret = cypress_fx3_mock_control(devc->mock, cmd, NULL, 0);
+	else
+		ret = libusb_control_transfer(usb->devhdl,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+			cmd, 0x0000, 0x0000, NULL, 0, USB_TIMEOUT);
 	if (ret < 0) {
-		sr_err("Unable to get version info: %s.",
+		sr_err("Unable to send %s command: %s.",
+		       cmd == CMD_PAUSE ? "pause" : "resume",
 		       libusb_error_name(ret));
 		return SR_ERR;
 	}
@@ -293,62 +513,212 @@ static int command_get_fw_version(libusb_device_handle *devhdl,
 	return SR_OK;
 }
 
-static int command_get_revid_version(struct sr_dev_inst *sdi, uint8_t *revid)
+static int LIBUSB_CALL renum_hotplug_cb(libusb_context *ctx,
+	libusb_device *dev, libusb_hotplug_event event, void *user_data)
 {
-	struct sr_usb_dev_inst *usb = sdi->conn;
-	libusb_device_handle *devhdl = usb->devhdl;
-	int ret;
+	struct renum_wait *w;
 
-	ret = libusb_control_transfer(devhdl, LIBUSB_REQUEST_TYPE_VENDOR |
-		LIBUSB_ENDPOINT_IN, CMD_GET_REVID_VERSION, 0x0000, 0x0000,
-		revid, 1, USB_TIMEOUT);
+	(void)ctx;
+	(void)dev;
+	(void)event;
 
-	if (ret < 0) {
-		sr_err("Unable to get REVID: %s.", libusb_error_name(ret));
-		return SR_ERR;
+	w = user_data;
+	w->arrived = 1;
+
+	/* Stay registered, the device may not be ready yet. */
+	return 0;
+}
+
+static gboolean has_firmware(const struct renum_wait *w, libusb_device *dev)
+{
+	struct libusb_device_descriptor des;
+
+	if (libusb_get_device_descriptor(dev, &des) < 0 || !w->plausible(&des))
+		return FALSE;
+
+	return usb_match_manuf_prod(dev, "sigrok", "cypress-fx3");
+}
+
+static gpointer device_key(libusb_device *dev)
+{
+	return GUINT_TO_POINTER(libusb_get_bus_number(dev) << 8
+		| libusb_get_device_address(dev));
+}
+
+/*
+ * Start watching for devices to come back. Call this before the firmware
+ * uploads, so that no arrival is missed.
+ */
+SR_PRIV void cypress_fx3_renum_wait_init(struct renum_wait *w,
+	struct sr_context *ctx,
+	gboolean (*plausible)(const struct libusb_device_descriptor *des))
+{
+	libusb_device **devlist;
+	int ret, i;
+
+	w->ctx = ctx;
+	w->registered = FALSE;
+	w->arrived = 0;
+	w->plausible = plausible;
+	w->present = NULL;
+
+	if (libusb_get_device_list(ctx->libusb_ctx, &devlist) >= 0) {
+		for (i = 0; devlist[i]; i++) {
+			if (has_firmware(w, devlist[i]))
+				w->present = g_slist_prepend(w->present,
+					device_key(devlist[i]));
+		}
+		libusb_free_device_list(devlist, 1);
+	}
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return;
+
+	ret = libusb_hotplug_register_callback(ctx->libusb_ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, renum_hotplug_cb, w, &w->handle);
+	if (ret == LIBUSB_SUCCESS)
+		w->registered = TRUE;
+	else
+		sr_dbg("No hotplug events (%s), polling instead.",
+		       libusb_error_name(ret));
+}
+
+SR_PRIV void cypress_fx3_renum_wait_clear(struct renum_wait *w)
+{
+	if (w->registered)
+		libusb_hotplug_deregister_callback(w->ctx->libusb_ctx, w->handle);
+	w->registered = FALSE;
+	g_slist_free(w->present);
+	w->present = NULL;
+}
+
+/* Did the device come up with our firmware since the wait started? */
+SR_PRIV gboolean cypress_fx3_renum_is_new(const struct renum_wait *w,
+	libusb_device *dev)
+{
+	return !g_slist_find(w->present, device_key(dev))
+		&& has_firmware(w, dev);
+}
+
+static unsigned int renumerated(const struct renum_wait *w)
+{
+	libusb_device **devlist;
+	unsigned int found;
+	int i;
+
+	if (libusb_get_device_list(w->ctx->libusb_ctx, &devlist) < 0)
+		return 0;
+
+	found = 0;
+	for (i = 0; devlist[i]; i++) {
+		if (cypress_fx3_renum_is_new(w, devlist[i]))
+			found++;
+	}
+	libusb_free_device_list(devlist, 1);
+
+	return found;
+}
+
+/*
+ * Wait for a device to arrive, or RENUM_POLL_MS at most, in case hotplug
+ * is not available or an arrival happened before. Returns SR_ERR_TIMEOUT
+ * once the deadline has passed.
+ */
+SR_PRIV int cypress_fx3_renum_wait_step(struct renum_wait *w,
+	int64_t deadline_us)
+{
+	struct timeval tv;
+	int64_t now, wait_us;
+
+	now = g_get_monotonic_time();
+	if (now >= deadline_us)
+		return SR_ERR_TIMEOUT;
+	wait_us = MIN(deadline_us - now, RENUM_POLL_MS * 1000);
+
+	if (w->registered) {
+		w->arrived = 0;
+		tv.tv_sec = wait_us / 1000000;
+		tv.tv_usec = wait_us % 1000000;
+		libusb_handle_events_timeout_completed(w->ctx->libusb_ctx,
+			&tv, &w->arrived);
+	} else {
+		g_usleep(wait_us);
 	}
 
 	return SR_OK;
 }
 
-static int command_start_acquisition(const struct sr_dev_inst *sdi)
+/*
+ * Wait until num_devices devices have come back with the firmware, at
+ * most until the deadline.
+ */
+SR_PRIV int cypress_fx3_renum_wait(struct renum_wait *w,
+	unsigned int num_devices, int64_t deadline_us)
 {
-	struct dev_context *devc;
-	struct sr_usb_dev_inst *usb;
-	uint64_t samplerate;
-	struct cmd_start_acquisition cmd;
 	int ret;
 
-	devc = sdi->priv;
-	usb = sdi->conn;
-	samplerate = devc->cur_samplerate;
+	while (renumerated(w) < num_devices) {
+		if ((ret = cypress_fx3_renum_wait_step(w, deadline_us)) != SR_OK)
+			return ret;
+	}
 
-	/* Compute the sample rate. */
-	if (devc->sample_wide && samplerate > MAX_16BIT_SAMPLE_RATE) {
-		sr_err("Unable to sample at %" PRIu64 "Hz "
-		       "when collecting 16-bit samples.", samplerate);
+	return SR_OK;
+}
+
+/* The firmware answers with a compatible version and its REVID. */
+static int check_firmware(const struct sr_dev_inst *sdi,
+	struct version_info *vi)
+{
+	uint8_t revid;
+
+	if (command_get_fw_version(sdi, vi) != SR_OK) {
+		sr_err("Failed to get firmware version.");
 		return SR_ERR;
 	}
 
-	cmd.sampling_factor = (FX3_PIB_CLOCK)/(samplerate);
-	
-	sr_spew("cmd.sampling_factor = %d",cmd.sampling_factor);
+	if (command_get_revid_version(sdi, &revid) != SR_OK) {
+		sr_err("Failed to get REVID.");
+		return SR_ERR;
+	}
 
-	/* Send the control message. */
-	ret = libusb_control_transfer(usb->devhdl, LIBUSB_REQUEST_TYPE_VENDOR |
-			LIBUSB_ENDPOINT_OUT, CMD_START, 0x0000, 0x0000,
-			(unsigned char *)&cmd, sizeof(cmd), USB_TIMEOUT);
-	if (ret < 0) {
-		sr_err("Unable to send start command: %s.",
-		       libusb_error_name(ret));
+	/*
+	 * Changes in major version mean incompatible/API changes, so
+	 * bail out if we encounter an incompatible version.
+	 * Different minor versions are OK, they should be compatible.
+	 */
+	if (vi->major != FX3_REQUIRED_VERSION_MAJOR) {
+		sr_err("Expected firmware version %d.x, "
+		       "got %d.%d.", FX3_REQUIRED_VERSION_MAJOR,
+		       vi->major, vi->minor);
 		return SR_ERR;
-	}else{
-		sr_info("CMD_START vendor command sent successfully");
 	}
 
 	return SR_OK;
 }
 
+/* Is the device already taken by another instance of the driver? */
+static gboolean device_in_use(const struct drv_context *drvc,
+	libusb_device *dev)
+{
+	const struct sr_dev_inst *sdi;
+	const struct sr_usb_dev_inst *usb;
+	GSList *l;
+
+	for (l = drvc->instances; l; l = l->next) {
+		sdi = l->data;
+		if (sdi->inst_type != SR_INST_USB || !(usb = sdi->conn))
+			continue;
+		if (usb->address != 0xff
+				&& usb->bus == libusb_get_bus_number(dev)
+				&& usb->address == libusb_get_device_address(dev))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 SR_PRIV int cypress_fx3_dev_open(struct sr_dev_inst *sdi, struct sr_dev_driver *di)
 {
 	libusb_device **devlist;
@@ -358,13 +728,21 @@ SR_PRIV int cypress_fx3_dev_open(struct sr_dev_inst *sdi, struct sr_dev_driver *
 	struct drv_context *drvc;
 	struct version_info vi;
 	int ret = SR_ERR, i, device_count;
-	uint8_t revid;
 	char connection_id[64];
 
 	drvc = di->context;
 	devc = sdi->priv;
 	usb = sdi->conn;
 
+	/* Loads the capture, then the same handshake as a real device. */
+	if (devc->mock) {
+		if (cypress_fx3_mock_open(devc->mock) != SR_OK)
+			return SR_ERR;
+		if ((ret = check_firmware(sdi, &vi)) != SR_OK)
+			cypress_fx3_mock_close(devc->mock);
+		return ret;
+	}
+
 	device_count = libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
 	if (device_count < 0) {
 		sr_err("Failed to get device list: %s.",
@@ -379,16 +757,26 @@ SR_PRIV int cypress_fx3_dev_open(struct sr_dev_inst *sdi, struct sr_dev_driver *
 		    || des.idProduct != devc->profile->pid)
 			continue;
 				
-		if ((sdi->status == SR_ST_INITIALIZING) ||
+		if (usb_get_port_path(devlist[i], connection_id, sizeof(connection_id)) < 0)
+		{
+			continue;
+		}
+
+		if (usb->address == 0xff) {
+			/*
+			 * Back from the firmware upload, possibly on another
+			 * bus, so the port path is of no use. Take the first
+			 * device with our firmware nobody else has taken.
+			 */
+			if (device_in_use(drvc, devlist[i])
+					|| !usb_match_manuf_prod(devlist[i],
+					"sigrok", "cypress-fx3"))
+				continue;
+		} else if ((sdi->status == SR_ST_INITIALIZING) ||
 				(sdi->status == SR_ST_INACTIVE)) {
 			/*
 			 * Check device by its physical USB bus/port address.
-			 */		
-			if (usb_get_port_path(devlist[i], connection_id, sizeof(connection_id)) < 0)
-			{
-				continue;
-			}
-
+			 */
 			if (strcmp(sdi->connection_id, connection_id))
 			{
 				/* This is not the one. */
@@ -397,12 +785,16 @@ SR_PRIV int cypress_fx3_dev_open(struct sr_dev_inst *sdi, struct sr_dev_driver *
 		}
 		
 		if (!(ret = libusb_open(devlist[i], &usb->devhdl))) {
-			if (usb->address == 0xff)
+			if (usb->address == 0xff) {
 				/*
 				 * First time we touch this device after FW
-				 * upload, so we don't know the address yet.
+				 * upload, so we don't know where it is yet.
 				 */
+				usb->bus = libusb_get_bus_number(devlist[i]);
 				usb->address = libusb_get_device_address(devlist[i]);
+				g_free(sdi->connection_id);
+				sdi->connection_id = g_strdup(connection_id);
+			}
 		} else {
 			sr_err("Failed to open device: %s.",
 			       libusb_error_name(ret));
@@ -421,29 +813,8 @@ SR_PRIV int cypress_fx3_dev_open(struct sr_dev_inst *sdi, struct sr_dev_driver *
 			}
 		}
 
-		ret = command_get_fw_version(usb->devhdl, &vi);
-		if (ret != SR_OK) {
-			sr_err("Failed to get firmware version.");
+		if ((ret = check_firmware(sdi, &vi)) != SR_OK)
 			break;
-		}
-
-		ret = command_get_revid_version(sdi, &revid);
-		if (ret != SR_OK) {
-			sr_err("Failed to get REVID.");
-			break;
-		}
-
-		/*
-		 * Changes in major version mean incompatible/API changes, so
-		 * bail out if we encounter an incompatible version.
-		 * Different minor versions are OK, they should be compatible.
-		 */
-		if (vi.major != FX3_REQUIRED_VERSION_MAJOR) {
-			sr_err("Expected firmware version %d.x, "
-			       "got %d.%d.", FX3_REQUIRED_VERSION_MAJOR,
-			       vi.major, vi.minor);
-			break;
-		}
 
 		sr_info("Opened device on %d.%d (logical) / %s (physical), "
 			"interface %d, firmware %d.%d.",
@@ -471,301 +842,2613 @@ SR_PRIV struct dev_context *cypress_fx3_dev_new(void)
 	devc->cur_samplerate = 0;
 	devc->limit_frames = 1;
 	devc->limit_samples = 0;
+	devc->numa_node = -1;
 	devc->capture_ratio = 0;
 	devc->sample_wide = FALSE;
 	devc->num_frames = 0;
 	devc->stl = NULL;
+	devc->queue_depth = DEFAULT_QUEUE_DEPTH;
+	devc->overflow_policy = OVERFLOW_BLOCK;
+	devc->acq_profile = PROFILE_THROUGHPUT;
+	devc->analog_trigger.source = -1;
+	devc->spill.fd = -1;
+	devc->analog_trigger.low = ANALOG_TRIGGER_LOW;
+	devc->analog_trigger.high = ANALOG_TRIGGER_HIGH;
 
 	return devc;
 }
 
-SR_PRIV void cypress_fx3_abort_acquisition(struct dev_context *devc)
+/*
+ * Allocate a buffer of the hot path. Without flags it is plain heap
+ * memory. Otherwise it gets a mapping of its own, so that it can sit on
+ * huge pages and be locked without affecting other allocations; what
+ * could not be done is noted in r->applied and reported by
+ * report_mem_region().
+ */
+static int mem_region_alloc(struct mem_region *r, size_t size,
+	unsigned int flags)
+{
+#ifdef __linux__
+	uint8_t *base;
+	size_t length, head, page;
+#endif
+
+	memset(r, 0, sizeof(*r));
+	r->flags = flags;
+
+#ifdef __linux__
+	if (flags) {
+		page = sysconf(_SC_PAGESIZE);
+		base = MAP_FAILED;
+		if (flags & MEM_HUGETLB) {
+			length = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+			base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (base != MAP_FAILED)
+				r->applied |= MEM_HUGETLB;
+		}
+		if (base == MAP_FAILED && (flags & (MEM_THP | MEM_HUGETLB))) {
+			/* Over-map and trim, THP needs aligned huge pages. */
+			length = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+			base = mmap(NULL, length + HUGE_PAGE_SIZE,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (base != MAP_FAILED) {
+				head = -(uintptr_t)base & (HUGE_PAGE_SIZE - 1);
+				if (head)
+					munmap(base, head);
+				munmap(base + head + length, HUGE_PAGE_SIZE - head);
+				base += head;
+				if (!madvise(base, length, MADV_HUGEPAGE))
+					r->applied |= MEM_THP;
+			}
+		}
+		if (base == MAP_FAILED) {
+			length = (size + page - 1) & ~(page - 1);
+			base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		}
+		if (base == MAP_FAILED)
+			return SR_ERR_MALLOC;
+
+		r->base = base;
+		r->size = size;
+		r->length = length;
+		r->mapped = TRUE;
+
+		if ((flags & MEM_LOCK) && !mlock(base, length))
+			r->applied |= MEM_LOCK;
+		if (flags & MEM_PREFAULT) {
+			/* mlock() faulted them in already. */
+			if (!(r->applied & MEM_LOCK))
+				memset(base, 0, length);
+			r->applied |= MEM_PREFAULT;
+		}
+
+		return SR_OK;
+	}
+#endif
+
+	if (!(r->base = g_try_malloc(size)))
+		return SR_ERR_MALLOC;
+	r->size = r->length = size;
+
+	return SR_OK;
+}
+
+static void mem_region_free(struct mem_region *r)
+{
+#ifdef __linux__
+	if (r->mapped) {
+		/* Unmapping unlocks as well. */
+		munmap(r->base, r->length);
+		memset(r, 0, sizeof(*r));
+		return;
+	}
+#endif
+	g_free(r->base);
+	memset(r, 0, sizeof(*r));
+}
+
+static void report_mem_region(const char *name, const struct mem_region *r)
+{
+	if (!r->base || !r->flags)
+		return;
+
+	sr_info("%s: %zu KiB on %s%s%s.", name, r->length / 1024,
+		(r->applied & MEM_HUGETLB) ? "hugetlbfs pages" :
+		(r->applied & MEM_THP) ? "THP advised pages" : "small pages",
+		(r->applied & MEM_LOCK) ? ", locked" : "",
+		(r->applied & MEM_PREFAULT) ? ", prefaulted" : "");
+	if ((r->flags & MEM_LOCK) && !(r->applied & MEM_LOCK))
+		sr_warn("%s could not be locked, see RLIMIT_MEMLOCK.", name);
+	if ((r->flags & (MEM_THP | MEM_HUGETLB))
+			&& !(r->applied & (MEM_THP | MEM_HUGETLB)))
+		sr_warn("%s could not use huge pages.", name);
+}
+
+/*
+ * All transient memory of an acquisition is carved from one arena: the
+ * queue, the transfer buffers, the staging buffers and the parser's
+ * scratch. Its region is kept while it is large enough, every
+ * acquisition carves from its beginning and finish_acquisition()
+ * releases everything at once. Only the libusb transfers themselves
+ * and the soft trigger are allocated elsewhere.
+ */
+static int arena_begin(struct arena *a, size_t size, unsigned int flags)
+{
+	a->used = 0;
+	if (a->region.base && a->region.size >= size
+			&& a->region.flags == flags)
+		return SR_OK;
+
+	mem_region_free(&a->region);
+	if (mem_region_alloc(&a->region, size, flags) != SR_OK) {
+		sr_err("Failed to allocate %zu byte arena.", size);
+		return SR_ERR_MALLOC;
+	}
+	sr_dbg("Allocated %zu byte arena.", size);
+
+	return SR_OK;
+}
+
+static size_t arena_size(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static void *arena_alloc(struct arena *a, size_t size)
+{
+	void *p;
+
+	if (arena_size(size) > a->region.size - a->used) {
+		sr_err("Arena exhausted by %zu byte allocation.", size);
+		return NULL;
+	}
+	p = (uint8_t *)a->region.base + a->used;
+	a->used += arena_size(size);
+
+	return p;
+}
+
+static void arena_end(struct arena *a)
+{
+	a->used = 0;
+}
+
+static void free_transfers(struct dev_context *devc)
+{
+	unsigned int i;
+
+	for (i = 0; i < devc->num_transfers; i++) {
+		if (!devc->transfers[i])
+			continue;
+		/* The buffers are in the arena. */
+		devc->transfers[i]->buffer = NULL;
+		libusb_free_transfer(devc->transfers[i]);
+	}
+	g_free(devc->transfers);
+	devc->transfers = NULL;
+	devc->num_transfers = 0;
+	devc->transfer_buffer_size = 0;
+	memset(&devc->queue, 0, sizeof(devc->queue));
+}
+
+SR_PRIV void cypress_fx3_free_buffers(struct dev_context *devc)
+{
+	/* Transfers on the bus still point into the arena. */
+	if (devc->submitted_transfers > 0) {
+		sr_warn("%d transfers still in flight, freeing them later.",
+			devc->submitted_transfers);
+		devc->free_deferred = TRUE;
+		return;
+	}
+	devc->free_deferred = FALSE;
+
+	free_transfers(devc);
+
+	mem_region_free(&devc->arena.region);
+	devc->arena.used = 0;
+	devc->logic_buffer = NULL;
+	devc->logic_buffer_size = 0;
+	devc->analog_buffer = NULL;
+	devc->analog_buffer_size = 0;
+	devc->packet_values = NULL;
+	devc->packet_samples = NULL;
+}
+
+/*
+ * Hand the transfers which wait for the parser back to the pool, their
+ * data is discarded. Returns the number of transfers that were flushed.
+ */
+static unsigned int flush_queue(struct dev_context *devc)
+{
+	struct transfer_queue *q;
+	unsigned int i, n;
+
+	q = &devc->queue;
+	n = q->count + q->num_held;
+
+	for (i = 0; i < q->count; i++)
+		q->idle[q->num_idle++] = q->ring[(q->head + i) % q->depth];
+	for (i = 0; i < q->num_held; i++)
+		q->idle[q->num_idle++] = q->held[i];
+	q->head = q->count = q->num_held = 0;
+
+	return n;
+}
+
+/*
+ * Transfer timeline tracing. When FX3_CONF_TRACE_FILE names a file at
+ * acquisition start, submissions, completions and parser
+ * runs are recorded into a preallocated buffer and written out as a
+ * Chrome/Perfetto trace (JSON) when the acquisition ends. Every pooled
+ * transfer gets its own track, the parser runs on track 0.
+ */
+static void trace_start(struct dev_context *devc)
+{
+	struct transfer_trace *trace;
+
+	if (!devc->trace_file)
+		return;
+
+	trace = g_try_malloc0(sizeof(*trace));
+	if (trace) {
+		trace->events = g_try_malloc(sizeof(*trace->events) * TRACE_MAX_EVENTS);
+		trace->submit_us = g_try_malloc0(sizeof(*trace->submit_us) * devc->num_transfers);
+	}
+	if (!trace || !trace->events || !trace->submit_us) {
+		sr_warn("Not enough memory for tracing.");
+		if (trace) {
+			g_free(trace->events);
+			g_free(trace->submit_us);
+		}
+		g_free(trace);
+		return;
+	}
+	trace->path = g_strdup(devc->trace_file);
+	trace->start_us = g_get_monotonic_time();
+	devc->trace = trace;
+
+	sr_info("Tracing transfers to %s.", trace->path);
+}
+
+static void trace_record(struct dev_context *devc, enum trace_event_type type,
+	unsigned int track, int64_t start_us, int64_t end_us, uint32_t bytes)
+{
+	struct transfer_trace *trace;
+	struct trace_event *ev;
+
+	trace = devc->trace;
+	if (trace->num_events == TRACE_MAX_EVENTS) {
+		trace->num_lost++;
+		return;
+	}
+
+	ev = &trace->events[trace->num_events++];
+	ev->type = type;
+	ev->track = track;
+	ev->ts_us = start_us - trace->start_us;
+	ev->dur_us = end_us - start_us;
+	ev->bytes = bytes;
+}
+
+static unsigned int trace_track(struct dev_context *devc,
+	struct libusb_transfer *transfer)
+{
+	unsigned int i;
+
+	for (i = 0; i < devc->num_transfers; i++) {
+		if (devc->transfers[i] == transfer)
+			return i + 1;
+	}
+
+	return 0;
+}
+
+static void trace_submitted(struct dev_context *devc,
+	struct libusb_transfer *transfer)
+{
+	unsigned int track;
+	int64_t now;
+
+	if (!TRACE_ENABLED(devc))
+		return;
+
+	track = trace_track(devc, transfer);
+	now = g_get_monotonic_time();
+	if (track)
+		devc->trace->submit_us[track - 1] = now;
+	trace_record(devc, TRACE_SUBMIT, track, now, now, 0);
+}
+
+static void trace_completed(struct dev_context *devc,
+	struct libusb_transfer *transfer)
+{
+	unsigned int track;
+
+	if (!TRACE_ENABLED(devc))
+		return;
+
+	track = trace_track(devc, transfer);
+	if (!track)
+		return;
+	trace_record(devc, TRACE_TRANSFER, track,
+		devc->trace->submit_us[track - 1], g_get_monotonic_time(),
+		transfer->actual_length);
+}
+
+static void trace_finish(struct dev_context *devc)
+{
+	static const char *names[] = {
+		[TRACE_SUBMIT] = "submit",
+		[TRACE_TRANSFER] = "transfer",
+		[TRACE_PARSE] = "parse",
+	};
+	struct transfer_trace *trace;
+	const struct trace_event *ev;
+	FILE *f;
+	size_t i;
+
+	if (!(trace = devc->trace))
+		return;
+	devc->trace = NULL;
+
+	if (!(f = g_fopen(trace->path, "w"))) {
+		sr_err("Failed to open trace file %s.", trace->path);
+		goto out;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":0,\"args\":{\"name\":\"parser\"}}");
+	for (i = 0; i < devc->num_transfers; i++)
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":1,\"tid\":%zu,\"args\":{\"name\":"
+			"\"transfer %zu\"}}", i + 1, i);
+	for (i = 0; i < trace->num_events; i++) {
+		ev = &trace->events[i];
+		if (ev->type == TRACE_SUBMIT)
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+				"\"ts\":%" PRIi64 ",\"pid\":1,\"tid\":%u}",
+				names[ev->type], ev->ts_us, ev->track);
+		else
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\","
+				"\"ts\":%" PRIi64 ",\"dur\":%" PRIi64 ","
+				"\"pid\":1,\"tid\":%u,\"args\":{\"bytes\":%u}}",
+				names[ev->type], ev->ts_us, ev->dur_us,
+				ev->track, ev->bytes);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	sr_info("Wrote %zu trace events to %s (%" PRIu64 " lost).",
+		trace->num_events, trace->path, trace->num_lost);
+
+out:
+	g_free(trace->path);
+	g_free(trace->submit_us);
+	g_free(trace->events);
+	g_free(trace);
+}
+
+/*
+ * Placement of the thread which handles the USB events, resubmits the
+ * transfers and runs the parser, i.e. the one calling receive_data().
+ * Scheduler latency on it is what overflows the FIFO of the device, so
+ * it can be pinned to the CPUs in FX3_CONF_CPUS (a list like "2,4-5") or
+ * to those of the NUMA node in FX3_CONF_NUMA_NODE, and run with
+ * SCHED_FIFO at the priority in FX3_CONF_RT_PRIORITY. Missing permissions
+ * are only warned about.
+ *
+ * The thread is usually the frontend's session thread, shared by all
+ * devices of the session. The first device acquiring on it tunes it,
+ * and its previous settings are restored once the last of them is done.
+ */
+#ifdef __linux__
+struct thread_tuning {
+	pthread_t thread;
+	/* Devices acquiring on the thread. */
+	unsigned int refs;
+	gboolean pinned;
+	cpu_set_t saved_cpus;
+	gboolean realtime;
+	int saved_policy;
+	struct sched_param saved_param;
+};
+
+/* The tuned threads, one entry however many devices use the thread. */
+static GSList *tuned_threads;
+static GMutex tuned_threads_mutex;
+
+static gboolean parse_cpu_list(const char *list, cpu_set_t *cpus)
 {
+	char **ranges, *end;
+	unsigned long first, last, cpu;
+	gboolean ok;
 	int i;
 
-	devc->acq_aborted = TRUE;
+	CPU_ZERO(cpus);
+	ok = TRUE;
+	ranges = g_strsplit(list, ",", 0);
+	for (i = 0; ok && ranges[i]; i++) {
+		if (!*g_strstrip(ranges[i]))
+			continue;
+		first = last = strtoul(ranges[i], &end, 10);
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		if (end == ranges[i] || *end || last < first
+				|| last >= CPU_SETSIZE) {
+			ok = FALSE;
+			break;
+		}
+		for (cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, cpus);
+	}
+	g_strfreev(ranges);
 
-	for (i = devc->num_transfers - 1; i >= 0; i--) {
-		if (devc->transfers[i])
-			libusb_cancel_transfer(devc->transfers[i]);
+	return ok && CPU_COUNT(cpus) > 0;
+}
+
+/* The CPUs to pin to, FALSE if none were asked for or they are invalid. */
+static gboolean thread_tuning_cpus(const struct dev_context *devc,
+	cpu_set_t *cpus)
+{
+	cpu_set_t node_cpus;
+	const char *list;
+	char *path, *contents;
+	int node;
+	gboolean ok;
+
+	list = devc->cpus;
+	node = devc->numa_node;
+	if ((!list || !*list) && node < 0)
+		return FALSE;
+
+	if (list && *list && !parse_cpu_list(list, cpus)) {
+		sr_warn("Ignoring invalid CPU list '%s'.", list);
+		return FALSE;
+	}
+	if (node < 0)
+		return TRUE;
+
+	path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+	ok = g_file_get_contents(path, &contents, NULL, NULL);
+	g_free(path);
+	if (!ok) {
+		sr_warn("Ignoring unknown NUMA node %d.", node);
+		return FALSE;
+	}
+	ok = parse_cpu_list(contents, &node_cpus);
+	g_free(contents);
+	if (!ok)
+		return FALSE;
+
+	if (!list || !*list) {
+		memcpy(cpus, &node_cpus, sizeof(node_cpus));
+	} else {
+		CPU_AND(cpus, cpus, &node_cpus);
+		if (!CPU_COUNT(cpus)) {
+			sr_warn("None of the CPUs '%s' is on NUMA node %d.",
+				list, node);
+			return FALSE;
+		}
 	}
+
+	return TRUE;
 }
 
-static void finish_acquisition(struct sr_dev_inst *sdi)
+static void thread_tuning_apply(struct dev_context *devc)
+{
+	struct thread_tuning *tt;
+	struct sched_param param;
+	cpu_set_t cpus;
+	GSList *l;
+	int prio, ret;
+
+	g_mutex_lock(&tuned_threads_mutex);
+
+	/* Tuned for another device of the session already. */
+	for (l = tuned_threads; l; l = l->next) {
+		tt = l->data;
+		if (pthread_equal(tt->thread, pthread_self())) {
+			tt->refs++;
+			devc->tuning = tt;
+			g_mutex_unlock(&tuned_threads_mutex);
+			return;
+		}
+	}
+
+	tt = g_malloc0(sizeof(*tt));
+	tt->thread = pthread_self();
+
+	if (thread_tuning_cpus(devc, &cpus)) {
+		pthread_getaffinity_np(tt->thread, sizeof(tt->saved_cpus),
+			&tt->saved_cpus);
+		if ((ret = pthread_setaffinity_np(tt->thread, sizeof(cpus),
+				&cpus)) != 0)
+			sr_warn("Failed to pin acquisition thread: %s.",
+				g_strerror(ret));
+		else
+			tt->pinned = TRUE;
+	}
+
+	if (devc->rt_priority > 0) {
+		prio = CLAMP(devc->rt_priority, sched_get_priority_min(SCHED_FIFO),
+			sched_get_priority_max(SCHED_FIFO));
+		pthread_getschedparam(tt->thread, &tt->saved_policy,
+			&tt->saved_param);
+		param.sched_priority = prio;
+		ret = pthread_setschedparam(tt->thread, SCHED_FIFO, &param);
+		if (ret == EPERM)
+			sr_warn("No permission for SCHED_FIFO, acquisition "
+				"thread keeps its priority (needs CAP_SYS_NICE "
+				"or an RLIMIT_RTPRIO of at least %d).", prio);
+		else if (ret != 0)
+			sr_warn("Failed to set SCHED_FIFO: %s.",
+				g_strerror(ret));
+		else
+			tt->realtime = TRUE;
+	}
+
+	if (!tt->pinned && !tt->realtime) {
+		g_free(tt);
+		g_mutex_unlock(&tuned_threads_mutex);
+		return;
+	}
+
+	sr_info("Acquisition thread: %s, %s.",
+		tt->pinned ? "pinned" : "not pinned",
+		tt->realtime ? "SCHED_FIFO" : "default policy");
+	tt->refs = 1;
+	tuned_threads = g_slist_prepend(tuned_threads, tt);
+	devc->tuning = tt;
+
+	g_mutex_unlock(&tuned_threads_mutex);
+}
+
+/* May run on another thread, when the acquisition is stopped. */
+static void thread_tuning_restore(struct dev_context *devc)
+{
+	struct thread_tuning *tt;
+
+	if (!(tt = devc->tuning))
+		return;
+	devc->tuning = NULL;
+
+	g_mutex_lock(&tuned_threads_mutex);
+	if (--tt->refs == 0) {
+		if (tt->realtime)
+			pthread_setschedparam(tt->thread, tt->saved_policy,
+				&tt->saved_param);
+		if (tt->pinned)
+			pthread_setaffinity_np(tt->thread,
+				sizeof(tt->saved_cpus), &tt->saved_cpus);
+		tuned_threads = g_slist_remove(tuned_threads, tt);
+		g_free(tt);
+	}
+	g_mutex_unlock(&tuned_threads_mutex);
+}
+#else
+static void thread_tuning_apply(struct dev_context *devc)
+{
+	if ((devc->cpus && *devc->cpus) || devc->numa_node >= 0
+			|| devc->rt_priority > 0)
+		sr_warn("Thread placement is not supported on this platform.");
+}
+
+static void thread_tuning_restore(struct dev_context *devc)
 {
+	(void)devc;
+}
+#endif
+
+static void send_analog_values(const struct sr_dev_inst *sdi,
+	float *values, size_t num_samples)
+{
+	struct sr_datafeed_analog analog;
+	struct sr_analog_encoding encoding;
+	struct sr_analog_meaning meaning;
+	struct sr_analog_spec spec;
+	struct sr_datafeed_packet packet;
 	struct dev_context *devc;
 
 	devc = sdi->priv;
+	sr_analog_init(&analog, &encoding, &meaning, &spec,
+		ANALOG_PACKET_CHANNELS);
+	analog.meaning->channels = devc->enabled_analog_channels;
+	analog.meaning->mq = SR_MQ_VOLTAGE;
+	analog.meaning->unit = SR_UNIT_VOLT;
+	analog.meaning->mqflags = 0;
+	analog.num_samples = num_samples;
+	analog.data = values;
+	encoding.is_float = TRUE;
+
+	packet.type = SR_DF_ANALOG;
+	packet.payload = &analog;
+	sr_session_send(sdi, &packet);
+}
 
-	std_session_send_df_end(sdi);
+static gboolean emit_deadline_passed(const struct sample_emitter *e)
+{
+	return e->fill && g_get_monotonic_time() - e->first_us >= e->flush_us;
+}
 
-	usb_source_remove(sdi->session, devc->ctx);
+static void analog_emit_flush(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
 
-	devc->num_transfers = 0;
-	g_free(devc->transfers);
+	devc = sdi->priv;
+	if (!devc->analog_emitter.fill)
+		return;
 
-	/* Free the deinterlace buffers if we had them. */
-	if (g_slist_length(devc->enabled_analog_channels) > 0) {
-		g_free(devc->logic_buffer);
-		g_free(devc->analog_buffer);
+	send_analog_values(sdi, devc->analog_buffer, devc->analog_emitter.fill);
+	devc->analog_emitter.fill = 0;
+}
+
+/* Where the parser puts the values of the next analog packet. */
+static float *analog_emit_cursor(const struct dev_context *devc)
+{
+	return devc->analog_buffer
+		+ devc->analog_emitter.fill * ANALOG_PACKET_CHANNELS;
+}
+
+/*
+ * Queue num_samples samples of the packet parsed at the cursor, from
+ * sample skip on. Anything not queued is overwritten by the next packet.
+ */
+static void analog_emit_commit(const struct sr_dev_inst *sdi, size_t skip,
+	size_t num_samples)
+{
+	struct dev_context *devc;
+	struct sample_emitter *e;
+	float *cursor;
+
+	devc = sdi->priv;
+	e = &devc->analog_emitter;
+	if (!num_samples)
+		return;
+
+	cursor = analog_emit_cursor(devc);
+	if (skip)
+		memmove(cursor, cursor + skip * ANALOG_PACKET_CHANNELS,
+			num_samples * ANALOG_PACKET_CHANNELS * sizeof(float));
+	if (!e->fill)
+		e->first_us = g_get_monotonic_time();
+	e->fill += num_samples;
+	if (e->fill + ANALOG_PACKET_SAMPLES > e->flush_samples)
+		analog_emit_flush(sdi);
+}
+
+static void analog_emit_check_deadline(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+	if (emit_deadline_passed(&devc->analog_emitter))
+		analog_emit_flush(sdi);
+}
+
+/*
+ * Host order samples to the little endian units of the session's logic.
+ * Dropping D8-D15 is a plain narrowing loop the compiler vectorizes.
+ */
+static void pack_logic(uint8_t *dst, const uint16_t *samples,
+	size_t num_samples, unsigned int unitsize)
+{
+	size_t i;
+
+	if (unitsize == 1) {
+		for (i = 0; i < num_samples; i++)
+			dst[i] = samples[i] & 0xff;
+		return;
+	}
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+	memcpy(dst, samples, num_samples * sizeof(uint16_t));
+#else
+	for (i = 0; i < num_samples; i++) {
+		dst[2 * i] = samples[i] & 0xff;
+		dst[2 * i + 1] = samples[i] >> 8;
 	}
+#endif
+}
 
-	if (devc->stl) {
-		soft_trigger_logic_free(devc->stl);
-		devc->stl = NULL;
+static void logic_emit_flush(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+	struct sr_datafeed_logic logic;
+	struct sr_datafeed_packet packet;
+
+	devc = sdi->priv;
+	if (!devc->logic_emitter.fill)
+		return;
+
+	logic.length = devc->logic_emitter.fill * devc->logic_unitsize;
+	logic.unitsize = devc->logic_unitsize;
+	logic.data = devc->logic_buffer;
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	sr_session_send(sdi, &packet);
+	devc->logic_emitter.fill = 0;
+}
+
+/* Queue decoded samples for the session, packed as they are queued. */
+static void logic_emit(const struct sr_dev_inst *sdi,
+	const uint16_t *samples, size_t num_samples)
+{
+	struct dev_context *devc;
+	struct sample_emitter *e;
+	size_t n;
+
+	devc = sdi->priv;
+	e = &devc->logic_emitter;
+	while (num_samples) {
+		if (!e->fill)
+			e->first_us = g_get_monotonic_time();
+		n = MIN(num_samples, e->flush_samples - e->fill);
+		pack_logic(devc->logic_buffer + e->fill * devc->logic_unitsize,
+			samples, n, devc->logic_unitsize);
+		e->fill += n;
+		samples += n;
+		num_samples -= n;
+		if (e->fill == e->flush_samples)
+			logic_emit_flush(sdi);
+	}
+}
+
+static void logic_emit_check_deadline(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+	if (emit_deadline_passed(&devc->logic_emitter))
+		logic_emit_flush(sdi);
+}
+
+/* Send stored samples right away, ahead of a trigger or frame end. */
+static void send_logic(const struct sr_dev_inst *sdi,
+	const uint16_t *samples, size_t num_samples)
+{
+	logic_emit(sdi, samples, num_samples);
+	logic_emit_flush(sdi);
+}
+
+/* Send the full slots as frames, oldest first. */
+static void segments_flush(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+	struct segment_store *s;
+	const struct segment *seg;
+	const uint16_t *slot;
+	unsigned int i;
+
+	devc = sdi->priv;
+	s = &devc->segments;
+
+	for (i = 0; i < s->num_done; i++) {
+		slot = s->slots + i * s->slot_samples;
+		seg = &s->segments[i];
+		std_session_send_df_frame_begin(sdi);
+		send_logic(sdi, slot + seg->ring_start,
+			seg->pre_samples - seg->ring_start);
+		send_logic(sdi, slot, seg->ring_start);
+		if (devc->stl)
+			std_session_send_df_trigger(sdi);
+		send_logic(sdi, slot + seg->pre_samples,
+			s->slot_samples - seg->pre_samples);
+		std_session_send_df_frame_end(sdi);
+	}
+	devc->num_frames += s->num_done;
+	s->num_done = 0;
+}
+
+/*
+ * Send the window as a frame, oldest sample first, and start over with
+ * an empty one.
+ */
+static void recorder_dump(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+	struct flight_recorder *r;
+	size_t tail, trigger_pos, first;
+
+	devc = sdi->priv;
+	r = &devc->recorder;
+	if (!r->fill)
+		return;
+
+	tail = (r->head + r->size - r->fill) % r->size;
+	trigger_pos = r->triggered ? r->fill - (r->post - r->remaining)
+		: r->fill;
+	first = MIN(r->fill, r->size - tail);
+
+	std_session_send_df_frame_begin(sdi);
+	if (trigger_pos < first) {
+		send_logic(sdi, r->ring + tail, trigger_pos);
+		std_session_send_df_trigger(sdi);
+		send_logic(sdi, r->ring + tail + trigger_pos, first - trigger_pos);
+		send_logic(sdi, r->ring, r->fill - first);
+	} else {
+		send_logic(sdi, r->ring + tail, first);
+		send_logic(sdi, r->ring, trigger_pos - first);
+		if (r->triggered)
+			std_session_send_df_trigger(sdi);
+		send_logic(sdi, r->ring + trigger_pos - first,
+			r->fill - trigger_pos);
+	}
+	std_session_send_df_frame_end(sdi);
+
+	devc->num_frames++;
+	r->num_dumps++;
+	r->head = r->fill = 0;
+	r->triggered = FALSE;
+	r->remaining = 0;
+}
+
+/* The capture file takes the samples of the logic data path. */
+static gboolean spill_wanted(const struct dev_context *devc)
+{
+	return devc->spill_file
+		&& g_slist_length(devc->enabled_analog_channels) == 0;
+}
+
+static size_t spill_block_size(const struct dev_context *devc)
+{
+	return devc->spill.fd >= 0 ? SPILL_BLOCK_SAMPLES * sizeof(uint16_t) : 0;
+}
+
+/* Transpose an 8x8 bit matrix, bit j of byte i goes to bit i of byte j. */
+static inline uint64_t transpose8(uint64_t x)
+{
+	uint64_t t;
+
+	t = (x ^ (x >> 7)) & UINT64_C(0x00AA00AA00AA00AA);
+	x ^= t ^ (t << 7);
+	t = (x ^ (x >> 14)) & UINT64_C(0x0000CCCC0000CCCC);
+	x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & UINT64_C(0x00000000F0F0F0F0);
+	x ^= t ^ (t << 28);
+
+	return x;
+}
+
+#ifdef __linux__
+/* Turn the collected block into bit planes at dst. */
+static void spill_transpose_block(const struct spill_store *sp, uint8_t *dst)
+{
+	const size_t plane = SPILL_BLOCK_SAMPLES / 8;
+	uint64_t lo, hi;
+	size_t i;
+	int j, c;
+
+	for (i = 0; i < SPILL_BLOCK_SAMPLES; i += 8) {
+		lo = hi = 0;
+		for (j = 0; j < 8; j++) {
+			lo |= (uint64_t)(sp->block[i + j] & 0xff) << (8 * j);
+			hi |= (uint64_t)(sp->block[i + j] >> 8) << (8 * j);
+		}
+		lo = transpose8(lo);
+		hi = transpose8(hi);
+		for (c = 0; c < 8; c++)
+			dst[c * plane + i / 8] = lo >> (8 * c);
+		if (sp->num_channels > 8) {
+			for (c = 0; c < 8; c++)
+				dst[(8 + c) * plane + i / 8] = hi >> (8 * c);
+		}
+	}
+}
+
+static int spill_write_header(const struct dev_context *devc)
+{
+	struct spill_header h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SPILL_MAGIC, sizeof(h.magic));
+	h.version = GUINT32_TO_LE(SPILL_VERSION);
+	h.num_channels = GUINT32_TO_LE(devc->spill.num_channels);
+	h.samplerate = GUINT64_TO_LE(devc->cur_samplerate);
+	h.block_samples = GUINT64_TO_LE(SPILL_BLOCK_SAMPLES);
+	h.num_samples = GUINT64_TO_LE(devc->spill.num_samples);
+	if (pwrite(devc->spill.fd, &h, sizeof(h), 0) != sizeof(h)) {
+		sr_err("Failed to write the capture file header: %s.",
+			g_strerror(errno));
+		return SR_ERR_IO;
+	}
+
+	return SR_OK;
+}
+
+static int spill_open(struct dev_context *devc)
+{
+	struct spill_store *sp;
+
+	sp = &devc->spill;
+	/* Left open by an acquisition which failed to start. */
+	if (sp->fd >= 0)
+		close(sp->fd);
+	memset(sp, 0, sizeof(*sp));
+	sp->fd = -1;
+	if (!spill_wanted(devc))
+		return SR_OK;
+
+	sp->fd = open(devc->spill_file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+		0644);
+	if (sp->fd < 0) {
+		sr_err("Failed to open capture file %s: %s.", devc->spill_file,
+			g_strerror(errno));
+		return SR_ERR_IO;
+	}
+	sp->num_channels = devc->sample_wide ? 16 : 8;
+	sp->block_bytes = sp->num_channels * SPILL_BLOCK_SAMPLES / 8;
+	sp->map_offset = SPILL_HEADER_SIZE;
+	if (spill_write_header(devc) != SR_OK) {
+		close(sp->fd);
+		sp->fd = -1;
+		return SR_ERR_IO;
+	}
+	sr_info("Capturing into %s.", devc->spill_file);
+
+	return SR_OK;
+}
+
+/*
+ * Map the next window of the capture file, growing the file to hold it.
+ * The writeback of the finished window is started right away, so dirty
+ * pages do not pile up in the page cache.
+ */
+static int spill_next_window(struct spill_store *sp)
+{
+	void *map;
+
+	if (sp->map) {
+		sync_file_range(sp->fd, sp->map_offset, SPILL_WINDOW_SIZE,
+			SYNC_FILE_RANGE_WRITE);
+		munmap(sp->map, SPILL_WINDOW_SIZE);
+		sp->map = NULL;
+		sp->map_offset += SPILL_WINDOW_SIZE;
+		sp->map_used = 0;
+	}
+	if (ftruncate(sp->fd, sp->map_offset + SPILL_WINDOW_SIZE) < 0) {
+		sr_err("Failed to grow the capture file: %s.", g_strerror(errno));
+		return SR_ERR_IO;
+	}
+	map = mmap(NULL, SPILL_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		sp->fd, sp->map_offset);
+	if (map == MAP_FAILED) {
+		sr_err("Failed to map the capture file: %s.", g_strerror(errno));
+		return SR_ERR_IO;
+	}
+	madvise(map, SPILL_WINDOW_SIZE, MADV_SEQUENTIAL);
+	sp->map = map;
+	sp->map_used = 0;
+
+	return SR_OK;
+}
+
+static int spill_flush_block(struct spill_store *sp)
+{
+	if ((!sp->map || sp->map_used == SPILL_WINDOW_SIZE)
+			&& spill_next_window(sp) != SR_OK)
+		return SR_ERR_IO;
+
+	spill_transpose_block(sp, sp->map + sp->map_used);
+	sp->map_used += sp->block_bytes;
+	sp->block_fill = 0;
+
+	return SR_OK;
+}
+
+/*
+ * Append samples to the capture file. On failure the capture stops, see
+ * process_data().
+ */
+static int spill_append(struct dev_context *devc, const uint16_t *samples,
+	size_t num_samples)
+{
+	struct spill_store *sp;
+	size_t n;
+
+	sp = &devc->spill;
+	while (num_samples) {
+		n = MIN(num_samples, SPILL_BLOCK_SAMPLES - sp->block_fill);
+		memcpy(sp->block + sp->block_fill, samples, n * sizeof(uint16_t));
+		sp->block_fill += n;
+		sp->num_samples += n;
+		samples += n;
+		num_samples -= n;
+		if (sp->block_fill == SPILL_BLOCK_SAMPLES
+				&& spill_flush_block(sp) != SR_OK) {
+			sp->failed = TRUE;
+			return SR_ERR_IO;
+		}
+	}
+
+	return SR_OK;
+}
+
+/* Write out the last block, trim the file and complete the header. */
+static void spill_close(struct dev_context *devc)
+{
+	struct spill_store *sp;
+	uint64_t length;
+
+	sp = &devc->spill;
+	if (sp->fd < 0)
+		return;
+
+	if (sp->block_fill && !sp->failed) {
+		memset(sp->block + sp->block_fill, 0,
+			(SPILL_BLOCK_SAMPLES - sp->block_fill) * sizeof(uint16_t));
+		if (spill_flush_block(sp) != SR_OK)
+			sp->failed = TRUE;
+	}
+	length = sp->map_offset + sp->map_used;
+	if (sp->map)
+		munmap(sp->map, SPILL_WINDOW_SIZE);
+	if (ftruncate(sp->fd, length) < 0)
+		sr_warn("Failed to trim the capture file: %s.", g_strerror(errno));
+	spill_write_header(devc);
+	close(sp->fd);
+
+	if (sp->failed)
+		sr_err("Capture file %s is incomplete, %" PRIu64 " samples.",
+			devc->spill_file, sp->num_samples);
+	else
+		sr_info("Captured %" PRIu64 " samples into %s.",
+			sp->num_samples, devc->spill_file);
+	memset(sp, 0, sizeof(*sp));
+	sp->fd = -1;
+}
+#else
+static int spill_open(struct dev_context *devc)
+{
+	memset(&devc->spill, 0, sizeof(devc->spill));
+	devc->spill.fd = -1;
+	if (!spill_wanted(devc))
+		return SR_OK;
+
+	sr_err("Capture files are not supported on this platform.");
+
+	return SR_ERR_NA;
+}
+
+static int spill_append(struct dev_context *devc, const uint16_t *samples,
+	size_t num_samples)
+{
+	(void)devc;
+	(void)samples;
+	(void)num_samples;
+
+	return SR_ERR_NA;
+}
+
+static void spill_close(struct dev_context *devc)
+{
+	(void)devc;
+}
+#endif
+
+/*
+ * Compress the frames of a finite capture on the logic data path, unless
+ * the samples go elsewhere. Index and data share the memory budget, the
+ * data never needs more than the frame as raw samples.
+ */
+static void cstore_init(struct dev_context *devc)
+{
+	struct compressed_store *cs;
+	uint64_t max_blocks, index_size, size;
+
+	cs = &devc->cstore;
+	memset(cs, 0, sizeof(*cs));
+
+	if (!devc->compress_memory || !devc->limit_samples
+			|| g_slist_length(devc->enabled_analog_channels) > 0
+			|| devc->segments.num_slots || devc->recorder.size
+			|| spill_wanted(devc))
+		return;
+
+	max_blocks = (devc->limit_samples + CSTORE_BLOCK_SAMPLES - 1)
+		/ CSTORE_BLOCK_SAMPLES;
+	index_size = max_blocks * sizeof(struct cstore_block);
+	if (index_size > devc->compress_memory / 4) {
+		sr_warn("Frames of %" PRIu64 " samples are too long to "
+			"compress in %" PRIu64 " bytes.", devc->limit_samples,
+			devc->compress_memory);
+		return;
+	}
+	size = MIN(devc->compress_memory - index_size,
+		devc->limit_samples * sizeof(uint16_t));
+
+	cs->size = size;
+	cs->max_blocks = max_blocks;
+}
+
+static size_t cstore_data_size(const struct dev_context *devc)
+{
+	return devc->cstore.size;
+}
+
+static size_t cstore_index_size(const struct dev_context *devc)
+{
+	return devc->cstore.max_blocks * sizeof(struct cstore_block);
+}
+
+static size_t cstore_block_size(const struct dev_context *devc)
+{
+	return devc->cstore.size ? CSTORE_BLOCK_SAMPLES * sizeof(uint16_t) : 0;
+}
+
+/* Number of leading samples equal to the first one. */
+static size_t run_length(const uint16_t *samples, size_t num_samples)
+{
+	const uint64_t pattern = samples[0] * UINT64_C(0x0001000100010001);
+	uint64_t w;
+	size_t i;
+
+	for (i = 1; i + 4 <= num_samples; i += 4) {
+		memcpy(&w, samples + i, sizeof(w));
+		if (w != pattern)
+			break;
+	}
+	while (i < num_samples && samples[i] == samples[0])
+		i++;
+
+	return i;
+}
+
+/* Returns the encoded size, or 0 if it would exceed max_size. */
+static size_t rle_encode(const uint16_t *samples, size_t num_samples,
+	uint8_t *out, size_t max_size)
+{
+	size_t i, n, len;
+
+	len = 0;
+	for (i = 0; i < num_samples; i += n) {
+		n = run_length(samples + i, num_samples - i);
+		if (len + 4 > max_size)
+			return 0;
+		out[len++] = samples[i] & 0xff;
+		out[len++] = samples[i] >> 8;
+		/* Runs are at most CSTORE_BLOCK_SAMPLES, two varint bytes. */
+		if (n < 0x80) {
+			out[len++] = n;
+		} else {
+			out[len++] = (n & 0x7f) | 0x80;
+			out[len++] = n >> 7;
+		}
+	}
+
+	return len;
+}
+
+static size_t rle_decode(const uint8_t *in, size_t num_samples,
+	uint16_t *samples)
+{
+	size_t i, n, j;
+	uint16_t v;
+
+	for (i = 0; i < num_samples; i += n) {
+		v = in[0] | in[1] << 8;
+		n = in[2] & 0x7f;
+		if (in[2] & 0x80) {
+			n |= in[3] << 7;
+			in++;
+		}
+		in += 3;
+		for (j = 0; j < n; j++)
+			samples[i + j] = v;
+	}
+
+	return num_samples;
+}
+
+static void planes_encode(const uint16_t *samples, size_t num_samples,
+	uint16_t constant, uint16_t values, uint8_t *out)
+{
+	const size_t plane = (num_samples + 7) / 8;
+	uint8_t *dst[16];
+	uint64_t lo, hi;
+	size_t i, k;
+	int j, c;
+
+	out[0] = constant & 0xff;
+	out[1] = constant >> 8;
+	out[2] = values & 0xff;
+	out[3] = values >> 8;
+	for (k = 0, c = 0; c < 16; c++)
+		dst[c] = constant & (1 << c) ? NULL : out + 4 + plane * k++;
+
+	for (i = 0; i < num_samples; i += 8) {
+		lo = hi = 0;
+		for (j = 0; j < 8 && i + j < num_samples; j++) {
+			lo |= (uint64_t)(samples[i + j] & 0xff) << (8 * j);
+			hi |= (uint64_t)(samples[i + j] >> 8) << (8 * j);
+		}
+		lo = transpose8(lo);
+		hi = transpose8(hi);
+		for (c = 0; c < 8; c++) {
+			if (dst[c])
+				dst[c][i / 8] = lo >> (8 * c);
+			if (dst[8 + c])
+				dst[8 + c][i / 8] = hi >> (8 * c);
+		}
+	}
+}
+
+static void planes_decode(const uint8_t *in, size_t num_samples,
+	uint16_t *samples)
+{
+	const size_t plane = (num_samples + 7) / 8;
+	const uint8_t *src[16];
+	uint16_t constant, values;
+	uint64_t lo, hi;
+	uint8_t byte;
+	size_t i, k;
+	int j, c;
+
+	constant = in[0] | in[1] << 8;
+	values = in[2] | in[3] << 8;
+	for (k = 0, c = 0; c < 16; c++)
+		src[c] = constant & (1 << c) ? NULL : in + 4 + plane * k++;
+
+	for (i = 0; i < num_samples; i += 8) {
+		lo = hi = 0;
+		for (c = 0; c < 16; c++) {
+			if (src[c])
+				byte = src[c][i / 8];
+			else
+				byte = values & (1 << c) ? 0xff : 0x00;
+			if (c < 8)
+				lo |= (uint64_t)byte << (8 * c);
+			else
+				hi |= (uint64_t)byte << (8 * (c - 8));
+		}
+		lo = transpose8(lo);
+		hi = transpose8(hi);
+		for (j = 0; j < 8 && i + j < num_samples; j++)
+			samples[i + j] = (lo >> (8 * j) & 0xff)
+				| (hi >> (8 * j) & 0xff) << 8;
+	}
+}
+
+#ifdef CSTORE_VERIFY
+static void cstore_verify_block(const struct compressed_store *cs,
+	const uint16_t *samples);
+#endif
+
+/*
+ * Compress the collected block into the store. Bit planes pay off when
+ * some channels do not change, runs when all are mostly idle, raw
+ * samples when everything is busy. Returns FALSE when out of space.
+ */
+static gboolean cstore_encode_block(struct compressed_store *cs)
+{
+	struct cstore_block *b;
+	const uint16_t *samples;
+	size_t n, i, room, planes_size, raw_size, len;
+	uint16_t all_and, all_or, constant, changing;
+	int num_changing;
+
+	samples = cs->block;
+	n = cs->block_fill;
+	room = cs->size - cs->used;
+	if (cs->num_blocks == cs->max_blocks)
+		return FALSE;
+
+	all_and = 0xffff;
+	all_or = 0;
+	for (i = 0; i < n; i++) {
+		all_and &= samples[i];
+		all_or |= samples[i];
+	}
+	constant = ~(all_and ^ all_or);
+	for (num_changing = 0, changing = ~constant; changing; num_changing++)
+		changing &= changing - 1;
+	planes_size = 4 + num_changing * ((n + 7) / 8);
+	raw_size = n * sizeof(uint16_t);
+
+	b = &cs->index[cs->num_blocks];
+	b->offset = cs->used;
+	b->num_samples = n;
+	if ((len = rle_encode(samples, n, cs->data + cs->used,
+			MIN(MIN(planes_size, raw_size) - 1, room)))) {
+		b->codec = CSTORE_RLE;
+	} else if (planes_size < raw_size && planes_size <= room) {
+		planes_encode(samples, n, constant, all_and & constant,
+			cs->data + cs->used);
+		b->codec = CSTORE_PLANES;
+		len = planes_size;
+	} else if (raw_size <= room) {
+		memcpy(cs->data + cs->used, samples, raw_size);
+		b->codec = CSTORE_RAW;
+		len = raw_size;
+	} else {
+		return FALSE;
+	}
+
+	cs->used += len;
+	cs->num_blocks++;
+	cs->block_fill = 0;
+
+#ifdef CSTORE_VERIFY
+	cstore_verify_block(cs, samples);
+#endif
+
+	return TRUE;
+}
+
+/* Decode block i of the store into samples, returns its sample count. */
+static size_t cstore_decode_block(const struct compressed_store *cs,
+	size_t i, uint16_t *samples)
+{
+	const struct cstore_block *b;
+	const uint8_t *in;
+
+	b = &cs->index[i];
+	in = cs->data + b->offset;
+	switch (b->codec) {
+	case CSTORE_RLE:
+		return rle_decode(in, b->num_samples, samples);
+	case CSTORE_PLANES:
+		planes_decode(in, b->num_samples, samples);
+		return b->num_samples;
+	default:
+		memcpy(samples, in, b->num_samples * sizeof(uint16_t));
+		return b->num_samples;
+	}
+}
+
+#ifdef CSTORE_VERIFY
+/*
+ * Decode the block just stored and compare it with its samples. Build with
+ * CSTORE_VERIFY defined to check the codecs on real captures.
+ */
+static void cstore_verify_block(const struct compressed_store *cs,
+	const uint16_t *samples)
+{
+	uint16_t decoded[CSTORE_BLOCK_SAMPLES];
+	const struct cstore_block *b;
+	size_t n;
+
+	b = &cs->index[cs->num_blocks - 1];
+	n = cstore_decode_block(cs, cs->num_blocks - 1, decoded);
+	if (n != b->num_samples || memcmp(decoded, samples,
+			n * sizeof(uint16_t)))
+		sr_err("Block %zu (codec %d) does not decode to its samples.",
+			cs->num_blocks - 1, b->codec);
+}
+#endif
+
+/*
+ * Add samples to the store. Returns how many it took, all of them unless
+ * it ran out of space.
+ */
+static size_t cstore_append(struct compressed_store *cs,
+	const uint16_t *samples, size_t num_samples)
+{
+	size_t n, taken;
+
+	for (taken = 0; taken < num_samples && !cs->full; taken += n) {
+		n = MIN(num_samples - taken,
+			CSTORE_BLOCK_SAMPLES - cs->block_fill);
+		memcpy(cs->block + cs->block_fill, samples + taken,
+			n * sizeof(uint16_t));
+		cs->block_fill += n;
+		if (cs->block_fill == CSTORE_BLOCK_SAMPLES
+				&& !cstore_encode_block(cs)) {
+			sr_warn("Compressed store full, ending the frame early.");
+			cs->full = TRUE;
+		}
+	}
+
+	return taken;
+}
+
+/* Send the stored frame, block by block, and empty the store. */
+static void cstore_flush(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+	struct compressed_store *cs;
+	uint64_t num_samples;
+	size_t i, n;
+
+	devc = sdi->priv;
+	cs = &devc->cstore;
+	if (!cs->size)
+		return;
+
+	if (cs->block_fill && !cs->full)
+		cstore_encode_block(cs);
+
+	num_samples = 0;
+	for (i = 0; i < cs->num_blocks; i++) {
+		n = cstore_decode_block(cs, i, cs->block);
+		send_logic(sdi, cs->block, n);
+		num_samples += n;
+	}
+	if (num_samples)
+		sr_dbg("Compressed %" PRIu64 " samples into %zu bytes.",
+			num_samples, cs->used);
+
+	cs->used = cs->num_blocks = cs->block_fill = 0;
+	cs->full = FALSE;
+}
+
+static void finish_acquisition(struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+	/* A later cypress_fx3_abort_acquisition() has nothing left to do. */
+	devc->acq_aborted = TRUE;
+
+	if (!devc->end_sent) {
+		/*
+		 * Stopped early, the segments captured so far still count.
+		 * Stopping the flight recorder freezes and sends its window.
+		 */
+		segments_flush(sdi);
+		recorder_dump(sdi);
+		cstore_flush(sdi);
+		analog_emit_flush(sdi);
+		logic_emit_flush(sdi);
+		std_session_send_df_end(sdi);
+	}
+	spill_close(devc);
+
+	if (devc->mock) {
+		cypress_fx3_mock_stop(devc->mock);
+		sr_session_source_remove(sdi->session, -1);
+	} else {
+		usb_source_remove(sdi->session, devc->ctx);
+	}
+
+	/*
+	 * The transfers stay in the pool, the next acquisition reuses them
+	 * unless their number changes. Their buffers and everything else
+	 * transient go back to the arena in one go below.
+	 */
+	flush_queue(devc);
+
+	if (devc->queue.num_blocked || devc->queue.num_dropped_oldest
+			|| devc->queue.num_dropped_newest
+			|| devc->queue.num_decimated)
+		sr_warn("Queue overflow: %" PRIu64 " blocked, %" PRIu64
+			" oldest dropped, %" PRIu64 " newest dropped, %" PRIu64
+			" decimated transfers (max. fill %u/%u).",
+			devc->queue.num_blocked, devc->queue.num_dropped_oldest,
+			devc->queue.num_dropped_newest, devc->queue.num_decimated,
+			devc->queue.max_fill, devc->queue.depth);
+
+	if (devc->queue.num_pauses) {
+		if (devc->queue.paused)
+			devc->queue.paused_us += g_get_monotonic_time()
+				- devc->queue.pause_start_us;
+		sr_info("Flow control: %" PRIu64 " pauses, %" PRIu64
+			" resumes, paused for %" PRIi64 "ms.",
+			devc->queue.num_pauses, devc->queue.num_resumes,
+			devc->queue.paused_us / 1000);
+	}
+
+	trace_finish(devc);
+	sync_group_leave(sdi);
+	thread_tuning_restore(devc);
+
+	if (devc->stl) {
+		soft_trigger_logic_free(devc->stl);
+		devc->stl = NULL;
+	}
+
+	arena_end(&devc->arena);
+}
+
+static int submit_transfer(struct dev_context *devc,
+	struct libusb_transfer *transfer)
+{
+	trace_submitted(devc, transfer);
+
+	if (devc->mock)
+		return cypress_fx3_mock_submit_transfer(devc->mock, transfer);
+
+	return libusb_submit_transfer(transfer);
+}
+
+static int cancel_transfer(struct dev_context *devc,
+	struct libusb_transfer *transfer)
+{
+	if (devc->mock)
+		return cypress_fx3_mock_cancel_transfer(devc->mock, transfer);
+
+	return libusb_cancel_transfer(transfer);
+}
+
+/*
+ * Return a transfer to the pool. The transfer is kept for the next
+ * acquisition, see cypress_fx3_free_buffers().
+ */
+static void release_transfer(struct libusb_transfer *transfer)
+{
+	struct sr_dev_inst *sdi;
+	struct dev_context *devc;
+
+	sdi = transfer->user_data;
+	devc = sdi->priv;
+
+	devc->submitted_transfers--;
+	if (devc->submitted_transfers == 0) {
+		finish_acquisition(sdi);
+		/* The device was closed while this one was on the bus. */
+		if (devc->free_deferred)
+			cypress_fx3_free_buffers(devc);
+	}
+}
+
+static void resubmit_transfer(struct libusb_transfer *transfer)
+{
+	struct sr_dev_inst *sdi;
+	int ret;
+
+	sdi = transfer->user_data;
+
+	if ((ret = submit_transfer(sdi->priv, transfer)) == LIBUSB_SUCCESS)
+		return;
+
+	sr_err("%s: %s", __func__, libusb_error_name(ret));
+	release_transfer(transfer);
+
+}
+
+SR_PRIV void cypress_fx3_abort_acquisition(struct dev_context *devc)
+{
+	int i;
+
+	/* Already aborted or wrapped up, the cancels went out before. */
+	if (devc->acq_aborted)
+		return;
+	devc->acq_aborted = TRUE;
+
+	/*
+	 * Queued transfers are not in flight, nothing calls back for them.
+	 * If no transfer is left on the bus, wrap up right here.
+	 */
+	flush_queue(devc);
+	if (devc->submitted_transfers == 0) {
+		if (devc->num_transfers)
+			finish_acquisition(devc->transfers[0]->user_data);
+		return;
+	}
+
+	for (i = devc->num_transfers - 1; i >= 0; i--) {
+		if (devc->transfers[i])
+			cancel_transfer(devc, devc->transfers[i]);
+	}
+}
+
+/*
+ * Handle events until the transfers on the bus, e.g. the ones cancelled
+ * by cypress_fx3_abort_acquisition(), have called back, for at most
+ * DRAIN_TIMEOUT_MS.
+ */
+SR_PRIV int cypress_fx3_drain_transfers(struct dev_context *devc)
+{
+	struct timeval tv;
+	int64_t deadline;
+
+	deadline = g_get_monotonic_time() + DRAIN_TIMEOUT_MS * 1000;
+	while (devc->submitted_transfers > 0
+			&& g_get_monotonic_time() < deadline) {
+		if (devc->mock) {
+			cypress_fx3_mock_handle_events(devc->mock);
+			g_usleep(MOCK_POLL_MS * 1000);
+			continue;
+		}
+		tv.tv_sec = 0;
+		tv.tv_usec = 10 * 1000;
+		libusb_handle_events_timeout(devc->ctx->libusb_ctx, &tv);
+	}
+
+	return devc->submitted_transfers > 0 ? SR_ERR_TIMEOUT : SR_OK;
+}
+
+static void submit_idle_transfer(struct dev_context *devc)
+{
+	struct transfer_queue *q;
+	struct libusb_transfer *transfer;
+	int ret;
+
+	q = &devc->queue;
+	if (!q->num_idle)
+		return;
+
+	transfer = q->idle[--q->num_idle];
+	if ((ret = submit_transfer(devc, transfer)) != LIBUSB_SUCCESS) {
+		sr_err("%s: %s", __func__, libusb_error_name(ret));
+		q->idle[q->num_idle++] = transfer;
+		return;
+	}
+	devc->submitted_transfers++;
+}
+
+static void push_transfer(struct transfer_queue *q,
+	struct libusb_transfer *transfer)
+{
+	q->ring[(q->head + q->count) % q->depth] = transfer;
+	if (++q->count > q->max_fill)
+		q->max_fill = q->count;
+}
+
+static struct libusb_transfer *pop_transfer(struct transfer_queue *q)
+{
+	struct libusb_transfer *transfer;
+
+	transfer = q->ring[q->head];
+	q->head = (q->head + 1) % q->depth;
+	q->count--;
+
+	return transfer;
+}
+
+/*
+ * Queue a completed transfer for the parser and keep the bus busy with
+ * a spare one from the pool. When the queue is full, the overflow policy
+ * decides what gets lost: nothing (the transfer is held back and the
+ * device stalls), the oldest queued data or the new data. The decimate
+ * policy starts to thin out early: above half of the queue depth only
+ * every 2nd transfer is kept, above three quarters every 4th one.
+ */
+static void queue_transfer(struct dev_context *devc,
+	struct libusb_transfer *transfer)
+{
+	struct transfer_queue *q;
+	unsigned int decimation;
+
+	q = &devc->queue;
+
+	if (devc->overflow_policy == OVERFLOW_DECIMATE) {
+		if (q->count < q->depth / 2)
+			decimation = 1;
+		else if (q->count < (q->depth * 3) / 4)
+			decimation = 2;
+		else
+			decimation = 4;
+		if (q->decimation_phase++ % decimation) {
+			q->num_decimated++;
+			resubmit_transfer(transfer);
+			return;
+		}
+	}
+
+	if (q->count == q->depth) {
+		switch (devc->overflow_policy) {
+		case OVERFLOW_BLOCK:
+			devc->submitted_transfers--;
+			q->held[q->num_held++] = transfer;
+			q->num_blocked++;
+			return;
+		case OVERFLOW_DROP_OLDEST:
+			q->idle[q->num_idle++] = pop_transfer(q);
+			q->num_dropped_oldest++;
+			break;
+		case OVERFLOW_DROP_NEWEST:
+		case OVERFLOW_DECIMATE:
+			q->num_dropped_newest++;
+			resubmit_transfer(transfer);
+			return;
+		}
+	}
+
+	devc->submitted_transfers--;
+	push_transfer(q, transfer);
+	submit_idle_transfer(devc);
+}
+
+/* Repack samples into trigger_buffer, in the soft trigger's unit size. */
+static void trigger_repack(const struct dev_context *devc,
+	const uint16_t *samples, size_t num_samples)
+{
+	uint8_t *buf;
+	size_t i;
+	int b;
+
+	buf = devc->trigger_buffer;
+	for (i = 0; i < num_samples; i++) {
+		for (b = 0; b < devc->stl->unitsize; b++)
+			*buf++ = b < 2 ? samples[i] >> (8 * b) : 0;
+	}
+}
+
+/*
+ * Can the pre-filter alone stand in for the soft trigger? It can for a
+ * single stage, and then it is all there is to the trigger state but the
+ * previous sample.
+ */
+static gboolean trigger_prefilter_only(const struct dev_context *devc)
+{
+	return devc->prefilter.usable && !devc->stl->trigger->stages->next;
+}
+
+static void trigger_set_prev_sample(struct soft_trigger_logic *stl,
+	uint16_t sample)
+{
+	int b;
+
+	for (b = 0; b < stl->unitsize; b++)
+		stl->prev_sample[b] = b < 2 ? sample >> (8 * b) : 0;
+}
+
+/*
+ * Run the soft trigger over decoded logic samples. It wants samples of
+ * its own unit size, so they are repacked into trigger_buffer first.
+ * Its stage and pre-trigger buffer carry over from one packet, and one
+ * transfer, to the next. When it fires, the pre-trigger samples have
+ * been sent and the frame begins. Returns the index of the trigger
+ * sample or -1.
+ */
+static int logic_trigger_check(struct sr_dev_inst *sdi,
+	const uint16_t *samples, size_t num_samples, int *pre_trigger_samples)
+{
+	struct dev_context *devc;
+	int trigger_offset;
+
+	devc = sdi->priv;
+	trigger_repack(devc, samples, num_samples);
+	trigger_offset = soft_trigger_prefilter_check(devc->stl,
+		&devc->prefilter, devc->trigger_buffer, num_samples,
+		pre_trigger_samples);
+	if (trigger_offset < 0)
+		return -1;
+
+	std_session_send_df_frame_begin(sdi);
+	devc->trigger_fired = TRUE;
+
+	return trigger_offset;
+}
+
+/*
+ * Offset of the first of num_samples values, stride floats apart, which
+ * is above (or below) the threshold, or num_samples.
+ */
+static size_t analog_find(const float *values, size_t stride,
+	size_t num_samples, float threshold, gboolean above)
+{
+	size_t i, j;
+
+	i = 0;
+#if defined(__GNUC__)
+	typedef float vecf __attribute__((vector_size(ANALOG_SCAN_BLOCK
+		* sizeof(float))));
+	typedef int32_t veci __attribute__((vector_size(ANALOG_SCAN_BLOCK
+		* sizeof(int32_t))));
+	const vecf t = (vecf){ 0 } + threshold;
+	int32_t lanes[ANALOG_SCAN_BLOCK], any;
+	vecf v;
+	veci hit;
+
+	for (; i + ANALOG_SCAN_BLOCK <= num_samples; i += ANALOG_SCAN_BLOCK) {
+		for (j = 0; j < ANALOG_SCAN_BLOCK; j++)
+			v[j] = values[(i + j) * stride];
+		hit = above ? (v > t) : (v < t);
+		memcpy(lanes, &hit, sizeof(lanes));
+		for (any = 0, j = 0; j < ANALOG_SCAN_BLOCK; j++)
+			any |= lanes[j];
+		if (any)
+			break;
+	}
+#endif
+	for (; i < num_samples; i++) {
+		if (above ? values[i * stride] > threshold
+				: values[i * stride] < threshold)
+			return i;
+	}
+
+	return num_samples;
+}
+
+/*
+ * Run the analog trigger over num_samples samples of all packet channels.
+ * The arming state carries over between calls. Returns the index of the
+ * trigger sample or num_samples.
+ */
+static size_t analog_trigger_scan(struct analog_trigger *t,
+	const float *values, size_t num_samples)
+{
+	const size_t stride = ANALOG_PACKET_CHANNELS;
+	const float *col;
+	size_t i;
+	float low, high, v;
+
+	col = values + t->source;
+	low = t->low;
+	high = t->high;
+	i = 0;
+	while (i < num_samples) {
+		if (!t->armed) {
+			switch (t->slope) {
+			case ANALOG_TRIGGER_RISING:
+				i += analog_find(col + i * stride, stride,
+					num_samples - i, low, FALSE);
+				break;
+			case ANALOG_TRIGGER_FALLING:
+				i += analog_find(col + i * stride, stride,
+					num_samples - i, high, TRUE);
+				break;
+			case ANALOG_TRIGGER_WINDOW:
+				for (; i < num_samples; i++) {
+					v = col[i * stride];
+					if (v >= low && v <= high)
+						break;
+				}
+				break;
+			}
+			if (i < num_samples)
+				t->armed = TRUE;
+			continue;
+		}
+
+		switch (t->slope) {
+		case ANALOG_TRIGGER_RISING:
+			i += analog_find(col + i * stride, stride,
+				num_samples - i, high, TRUE);
+			break;
+		case ANALOG_TRIGGER_FALLING:
+			i += analog_find(col + i * stride, stride,
+				num_samples - i, low, FALSE);
+			break;
+		case ANALOG_TRIGGER_WINDOW:
+			i += MIN(analog_find(col + i * stride, stride,
+				num_samples - i, low, FALSE),
+				analog_find(col + i * stride, stride,
+				num_samples - i, high, TRUE));
+			break;
+		}
+		if (i < num_samples)
+			return i;
+	}
+
+	return num_samples;
+}
+
+static void analog_trigger_reset(struct analog_trigger *t)
+{
+	t->armed = FALSE;
+	t->ring_head = t->ring_fill = 0;
+}
+
+/* Keep the last ring_size of these samples for the pre-trigger data. */
+static void analog_trigger_append(struct analog_trigger *t,
+	const float *values, size_t num_samples)
+{
+	size_t n;
+
+	if (!t->ring_size)
+		return;
+
+	if (num_samples > t->ring_size) {
+		values += (num_samples - t->ring_size) * ANALOG_PACKET_CHANNELS;
+		num_samples = t->ring_size;
+	}
+	while (num_samples) {
+		n = MIN(num_samples, t->ring_size - t->ring_head);
+		memcpy(t->ring + t->ring_head * ANALOG_PACKET_CHANNELS, values,
+			n * ANALOG_PACKET_CHANNELS * sizeof(float));
+		values += n * ANALOG_PACKET_CHANNELS;
+		num_samples -= n;
+		t->ring_head = (t->ring_head + n) % t->ring_size;
+		t->ring_fill = MIN(t->ring_fill + n, t->ring_size);
+	}
+}
+
+/*
+ * Run the analog trigger over the samples of a packet. Until it fires,
+ * they go into the pre-trigger ring. When it fires the frame begins, the
+ * ring is sent, oldest sample first, followed by the trigger marker.
+ * Returns the index of the trigger sample or -1.
+ */
+static int analog_trigger_check(struct sr_dev_inst *sdi,
+	const float *values, size_t num_samples, int *pre_trigger_samples)
+{
+	struct dev_context *devc;
+	struct analog_trigger *t;
+	size_t idx, tail;
+
+	devc = sdi->priv;
+	t = &devc->analog_trigger;
+
+	idx = analog_trigger_scan(t, values, num_samples);
+	analog_trigger_append(t, values, idx);
+	if (idx == num_samples)
+		return -1;
+
+	std_session_send_df_frame_begin(sdi);
+	if (t->ring_fill) {
+		tail = (t->ring_head + t->ring_size - t->ring_fill) % t->ring_size;
+		if (tail + t->ring_fill > t->ring_size) {
+			send_analog_values(sdi, t->ring
+				+ tail * ANALOG_PACKET_CHANNELS,
+				t->ring_size - tail);
+			send_analog_values(sdi, t->ring,
+				t->ring_fill - (t->ring_size - tail));
+		} else {
+			send_analog_values(sdi, t->ring
+				+ tail * ANALOG_PACKET_CHANNELS, t->ring_fill);
+		}
+	}
+	std_session_send_df_trigger(sdi);
+
+	*pre_trigger_samples = t->ring_fill;
+	analog_trigger_reset(t);
+	devc->trigger_fired = TRUE;
+
+	return idx;
+}
+
+/* Send the samples of the logic and analog packets in data. */
+static uint64_t mso_send_data_proc(struct sr_dev_inst *sdi,
+	uint8_t *data, size_t length, uint64_t max_samples, size_t *consumed)
+{
+	struct dev_context *devc = sdi->priv;
+	struct parsed_packet pkt;
+	uint64_t sent = 0;
+
+	size_t offset = 0;
+
+	while (offset + HEADER_SIZE <= length && sent < max_samples) {
+		/* Analog values land in the emitter, ready to be queued. */
+		int parsed_len = fx3driver_parse_next_packet(&data[offset],
+			length - offset, &pkt, analog_emit_cursor(devc),
+			devc->packet_samples);
+
+		if (parsed_len <= 0) {
+			sr_err("Invalid or incomplete packet at offset %zu.", offset);
+			break;
+		}
+
+		// if it sees channel_type 0xFF send samples to digital channels
+		if (pkt.channel_type == 0xFF && devc->stl
+				&& !devc->trigger_fired) {
+			/*
+			 * A logic trigger gates the analog data. Its pre-trigger
+			 * samples go out as logic, they do not count against
+			 * the analog sample limit.
+			 */
+			size_t skip = sync_skip(devc, &pkt);
+			int pre_trigger_samples;
+			logic_trigger_check(sdi, pkt.digital_samples + skip,
+				pkt.num_samples - skip, &pre_trigger_samples);
+		} else if (pkt.channel_type == 0x00 && (devc->trigger_fired
+				|| devc->analog_trigger.active)) {
+			size_t num_channels = ANALOG_PACKET_CHANNELS;
+			size_t skip = sync_skip(devc, &pkt);
+			if (!devc->trigger_fired) {
+				int pre_trigger_samples;
+				int trigger_offset = analog_trigger_check(sdi,
+					pkt.analog_samples + skip * num_channels,
+					pkt.num_samples - skip, &pre_trigger_samples);
+				if (trigger_offset < 0) {
+					offset += parsed_len;
+					continue;
+				}
+				sent += pre_trigger_samples;
+				skip += trigger_offset;
+			}
+			size_t num_samples = MIN(pkt.num_samples - skip, max_samples - sent);
+			analog_emit_commit(sdi, skip, num_samples);
+			sent += num_samples;
+		}
+		offset += parsed_len;
+	}
+	analog_emit_check_deadline(sdi);
+
+	*consumed = offset;
+
+	return sent;
+}
+
+static uint64_t la_send_data_proc(struct sr_dev_inst *sdi,
+	uint8_t *data, size_t length, uint64_t max_samples, size_t *consumed)
+{
+	struct dev_context *devc = sdi->priv;
+	struct parsed_packet pkt;
+	uint64_t sent = 0;
+
+	size_t offset = 0;
+
+	while (offset + HEADER_SIZE <= length && sent < max_samples) {
+		int parsed_len = fx3driver_parse_next_packet(&data[offset],
+			length - offset, &pkt, devc->packet_values,
+			devc->packet_samples);
+
+		if (parsed_len <= 0) {
+			sr_err("Invalid or incomplete packet at offset %zu.", offset);
+			break;
+		}
+
+	// if it sees channel_type 0xFF send samples to digital channels
+	if (pkt.channel_type == 0xFF) {
+
+		size_t skip = sync_skip(devc, &pkt);
+		if (!devc->trigger_fired) {
+			int pre_trigger_samples;
+			int trigger_offset = logic_trigger_check(sdi,
+				pkt.digital_samples + skip, pkt.num_samples - skip,
+				&pre_trigger_samples);
+			if (trigger_offset < 0) {
+				offset += parsed_len;
+				continue;
+			}
+			sent += pre_trigger_samples;
+			skip += trigger_offset;
+		}
+		size_t num_samples = MIN(pkt.num_samples - skip, max_samples - sent);
+		if (devc->spill.fd >= 0) {
+			if (spill_append(devc, pkt.digital_samples + skip,
+					num_samples) != SR_OK)
+				break;
+			sent += num_samples;
+			offset += parsed_len;
+			continue;
+		}
+		if (devc->cstore.size) {
+			sent += cstore_append(&devc->cstore,
+				pkt.digital_samples + skip, num_samples);
+			offset += parsed_len;
+			if (devc->cstore.full)
+				break;
+			continue;
+		}
+		logic_emit(sdi, pkt.digital_samples + skip, num_samples);
+		sent += num_samples;
+	}
+
+
+		offset += parsed_len;
+
+	}
+	logic_emit_check_deadline(sdi);
+
+	*consumed = offset;
+
+	return sent;
+}
+
+/* Segmented capture stores 16 bit samples, like la_send_data_proc(). */
+static size_t segments_size(const struct dev_context *devc)
+{
+	return devc->segments.num_slots * devc->segments.slot_samples
+		* sizeof(uint16_t);
+}
+
+/*
+ * Decide whether the frames of this acquisition are captured segmented.
+ * That takes a known number of frames of a known length on the logic
+ * data path, and a trigger that the pre-filter alone can evaluate, i.e.
+ * a single stage.
+ */
+static void segments_init(struct dev_context *devc)
+{
+	struct segment_store *s;
+
+	s = &devc->segments;
+	memset(s, 0, sizeof(*s));
+
+	if (devc->limit_frames < 2 || !devc->limit_samples
+			|| g_slist_length(devc->enabled_analog_channels) > 0
+			|| spill_wanted(devc))
+		return;
+	if (devc->stl && !trigger_prefilter_only(devc)) {
+		sr_info("Trigger too complex for segmented capture, "
+			"sending frames as they come.");
+		return;
+	}
+	if (devc->limit_samples > SEGMENT_MEMORY_MAX / sizeof(uint16_t)
+			/ devc->limit_frames) {
+		sr_warn("%" PRIu64 " frames of %" PRIu64 " samples exceed the "
+			"segment store, sending frames as they come.",
+			devc->limit_frames, devc->limit_samples);
+		return;
+	}
+
+	s->num_slots = devc->limit_frames;
+	s->slot_samples = devc->limit_samples;
+	if (devc->stl)
+		s->ring_size = (devc->capture_ratio * devc->limit_samples) / 100;
+	sr_info("Segmented capture: %u frames of %zu samples.",
+		s->num_slots, s->slot_samples);
+}
+
+/* Keep the last ring_size of these samples at the start of the slot. */
+static void segment_ring_push(struct segment_store *s, uint16_t *slot,
+	const uint16_t *samples, size_t num_samples)
+{
+	size_t n;
+
+	if (!s->ring_size)
+		return;
+
+	if (num_samples > s->ring_size) {
+		samples += num_samples - s->ring_size;
+		num_samples = s->ring_size;
+	}
+	while (num_samples) {
+		n = MIN(num_samples, s->ring_size - s->ring_head);
+		memcpy(slot + s->ring_head, samples, n * sizeof(uint16_t));
+		samples += n;
+		num_samples -= n;
+		s->ring_head = (s->ring_head + n) % s->ring_size;
+		s->ring_fill = MIN(s->ring_fill + n, s->ring_size);
+	}
+}
+
+/*
+ * Store samples into the current slot. Until the trigger fires they only
+ * go into the pre-trigger ring, without a trigger it fires right away.
+ * Returns the number of samples used, which is less than num_samples
+ * only when the slot has been filled.
+ */
+static size_t segment_store_feed(struct dev_context *devc,
+	const uint16_t *samples, size_t num_samples)
+{
+	struct segment_store *s;
+	struct soft_trigger_logic *stl;
+	struct segment *seg;
+	uint16_t *slot;
+	size_t n, used;
+
+	s = &devc->segments;
+	stl = devc->stl;
+	slot = s->slots + s->num_done * s->slot_samples;
+	used = 0;
+
+	if (!s->capturing && stl) {
+		trigger_repack(devc, samples, num_samples);
+		used = soft_trigger_prefilter_scan(&devc->prefilter,
+			devc->trigger_buffer, num_samples, stl->unitsize,
+			stl->prev_sample);
+		segment_ring_push(s, slot, samples, used);
+	}
+	if (!s->capturing && used < num_samples) {
+		seg = &s->segments[s->num_done];
+		seg->ring_start = s->ring_fill == s->ring_size ? s->ring_head : 0;
+		seg->pre_samples = s->ring_fill;
+		s->pos = s->ring_fill;
+		s->capturing = TRUE;
+	}
+
+	if (s->capturing) {
+		n = MIN(num_samples - used, s->slot_samples - s->pos);
+		memcpy(slot + s->pos, samples + used, n * sizeof(uint16_t));
+		s->pos += n;
+		used += n;
+		if (s->pos == s->slot_samples) {
+			s->num_done++;
+			s->capturing = FALSE;
+			s->ring_head = s->ring_fill = 0;
+		}
+	}
+
+	if (stl && used)
+		trigger_set_prev_sample(stl, samples[used - 1]);
+
+	return used;
+}
+
+/*
+ * The send proc of segmented capture. Nothing goes out, the samples of
+ * the digital packets are stored until the last slot is full. Returns the
+ * number of samples parsed.
+ */
+static uint64_t segment_send_data_proc(struct sr_dev_inst *sdi,
+	uint8_t *data, size_t length, uint64_t max_samples, size_t *consumed)
+{
+	struct dev_context *devc;
+	struct segment_store *s;
+	struct parsed_packet pkt;
+	const uint16_t *samples;
+	size_t offset, skip, num_samples, used;
+	uint64_t parsed;
+	int parsed_len;
+
+	(void)max_samples;
+
+	devc = sdi->priv;
+	s = &devc->segments;
+	offset = 0;
+	parsed = 0;
+
+	while (offset + HEADER_SIZE <= length && s->num_done < s->num_slots) {
+		parsed_len = fx3driver_parse_next_packet(&data[offset],
+			length - offset, &pkt, devc->packet_values,
+			devc->packet_samples);
+		if (parsed_len <= 0) {
+			sr_err("Invalid or incomplete packet at offset %zu.", offset);
+			break;
+		}
+		offset += parsed_len;
+		/* Packets the parser skipped have no samples decoded. */
+		if (pkt.channel_type != 0xFF)
+			continue;
+
+		skip = sync_skip(devc, &pkt);
+		samples = pkt.digital_samples + skip;
+		num_samples = pkt.num_samples - skip;
+		parsed += num_samples;
+		while (num_samples && s->num_done < s->num_slots) {
+			used = segment_store_feed(devc, samples, num_samples);
+			samples += used;
+			num_samples -= used;
+		}
+	}
+
+	*consumed = offset;
+
+	return parsed;
+}
+
+/*
+ * Record in continuous mode with a recorder window and no sample limit.
+ * The capture ratio splits the window around the trigger. Like segmented
+ * capture, this is for the logic data path and a trigger which the
+ * pre-filter can evaluate.
+ */
+static void recorder_init(struct dev_context *devc)
+{
+	struct flight_recorder *r;
+	uint64_t size;
+
+	r = &devc->recorder;
+	memset(r, 0, sizeof(*r));
+
+	if (!devc->continuous || !devc->recorder_msec || devc->limit_samples
+			|| g_slist_length(devc->enabled_analog_channels) > 0
+			|| spill_wanted(devc))
+		return;
+	if (devc->stl && !trigger_prefilter_only(devc)) {
+		sr_info("Trigger too complex for the flight recorder, "
+			"streaming instead.");
+		return;
+	}
+
+	size = devc->recorder_msec * devc->cur_samplerate / 1000;
+	if (size > RECORDER_MEMORY_MAX / sizeof(uint16_t)) {
+		size = RECORDER_MEMORY_MAX / sizeof(uint16_t);
+		sr_warn("Flight recorder window cut down to %" PRIu64 "ms.",
+			size * 1000 / devc->cur_samplerate);
 	}
+	if (!size)
+		return;
+
+	r->size = size;
+	if (devc->stl)
+		r->post = size * (100 - devc->capture_ratio) / 100;
+	sr_info("Flight recorder: %zu samples, %zu after the trigger.",
+		r->size, r->post);
 }
 
-static void free_transfer(struct libusb_transfer *transfer)
+static size_t recorder_ring_size(const struct dev_context *devc)
 {
-	struct sr_dev_inst *sdi;
-	struct dev_context *devc;
-	unsigned int i;
-
-	sdi = transfer->user_data;
-	devc = sdi->priv;
+	return devc->recorder.size * sizeof(uint16_t);
+}
 
-	g_free(transfer->buffer);
-	transfer->buffer = NULL;
-	libusb_free_transfer(transfer);
+static void recorder_push(struct flight_recorder *r,
+	const uint16_t *samples, size_t num_samples)
+{
+	size_t n;
 
-	for (i = 0; i < devc->num_transfers; i++) {
-		if (devc->transfers[i] == transfer) {
-			devc->transfers[i] = NULL;
-			break;
-		}
+	if (num_samples > r->size) {
+		samples += num_samples - r->size;
+		num_samples = r->size;
+	}
+	while (num_samples) {
+		n = MIN(num_samples, r->size - r->head);
+		memcpy(r->ring + r->head, samples, n * sizeof(uint16_t));
+		samples += n;
+		num_samples -= n;
+		r->head = (r->head + n) % r->size;
+		r->fill = MIN(r->fill + n, r->size);
 	}
-
-	devc->submitted_transfers--;
-	if (devc->submitted_transfers == 0)
-		finish_acquisition(sdi);
 }
 
-static void resubmit_transfer(struct libusb_transfer *transfer)
+/*
+ * Record samples, watching for the trigger. Returns the number of samples
+ * used, which is less than num_samples only when the window has been
+ * frozen and is due to be sent.
+ */
+static size_t recorder_feed(struct dev_context *devc,
+	const uint16_t *samples, size_t num_samples)
 {
-	int ret;
-
-	if ((ret = libusb_submit_transfer(transfer)) == LIBUSB_SUCCESS)
-		return;
+	struct flight_recorder *r;
+	struct soft_trigger_logic *stl;
+	size_t hit, n;
+
+	r = &devc->recorder;
+	stl = devc->stl;
+
+	if (!r->triggered) {
+		hit = num_samples;
+		if (stl) {
+			trigger_repack(devc, samples, num_samples);
+			hit = soft_trigger_prefilter_scan(&devc->prefilter,
+				devc->trigger_buffer, num_samples,
+				stl->unitsize, stl->prev_sample);
+		}
+		recorder_push(r, samples, hit);
+		if (stl && hit)
+			trigger_set_prev_sample(stl, samples[hit - 1]);
+		if (hit == num_samples)
+			return num_samples;
+		r->triggered = TRUE;
+		r->remaining = r->post;
+		samples += hit;
+		num_samples -= hit;
+	} else {
+		hit = 0;
+	}
 
-	sr_err("%s: %s", __func__, libusb_error_name(ret));
-	free_transfer(transfer);
+	n = MIN(num_samples, r->remaining);
+	recorder_push(r, samples, n);
+	r->remaining -= n;
+	if (n)
+		trigger_set_prev_sample(stl, samples[n - 1]);
 
+	return hit + n;
 }
 
-// retrieve and put actual samples from incoming packets
-static void mso_send_data_proc(struct sr_dev_inst *sdi,
-	uint8_t *data, size_t length, size_t sample_width)
+/*
+ * The send proc of the flight recorder. Returns the number of samples
+ * parsed, all of them go into the recorder.
+ */
+static uint64_t recorder_send_data_proc(struct sr_dev_inst *sdi,
+	uint8_t *data, size_t length, uint64_t max_samples, size_t *consumed)
 {
-	 
-	struct sr_datafeed_analog analog;
-	struct sr_analog_encoding encoding;
-	struct sr_analog_meaning meaning;
-	struct sr_analog_spec spec;
-	struct dev_context *devc = sdi->priv;
+	struct dev_context *devc;
+	struct flight_recorder *r;
 	struct parsed_packet pkt;
-	(void)sample_width;
+	const uint16_t *samples;
+	size_t offset, skip, num_samples, used;
+	uint64_t parsed;
+	int parsed_len;
 
-	size_t offset = 0;
+	(void)max_samples;
 
-	sr_err("mso_send_data_proc started ");
+	devc = sdi->priv;
+	r = &devc->recorder;
+	offset = 0;
+	parsed = 0;
 
 	while (offset + HEADER_SIZE <= length) {
-		int parsed_len = fx3driver_parse_next_packet(&data[offset], length - offset, &pkt);
-
-		// if(parsed_len == -3){
-		// 	sr_err("Skipping to next packet %zu.", offset);
-		// 	continue;;
-		// }
+		parsed_len = fx3driver_parse_next_packet(&data[offset],
+			length - offset, &pkt, devc->packet_values,
+			devc->packet_samples);
 		if (parsed_len <= 0) {
 			sr_err("Invalid or incomplete packet at offset %zu.", offset);
 			break;
 		}
+		offset += parsed_len;
+		if (pkt.channel_type != 0xFF)
+			continue;
 
-		// if it sees channel_type 0xFF send samples to digital channels
-		if (pkt.channel_type == 0x00) {
-			//size_t num_channels = devc->enabled_analog_channels;
-			size_t num_channels = 8;
-			int sample_width = 1; // Assuming 16-bit samples
-			//size_t needed_bytes = pkt.num_samples * sample_width; // we are retriveing 8 samples, each sample is 1 bytes, so the toaotl length will be 8*1 = 8 bytes 
-			size_t needed_bytes = pkt.num_samples * num_channels * sizeof(float);
-			if (needed_bytes > devc->analog_buffer_size) {
-				devc->analog_buffer = g_realloc(devc->analog_buffer, needed_bytes);
-				devc->analog_buffer_size = needed_bytes;
-			}
-
-
-			memcpy(devc->analog_buffer, pkt.analog_samples,needed_bytes);
-
-			//memcpy(devc->analog_buffer, pkt.analog_samples,needed_bytes);
-			
-
-			sr_analog_init(&analog, &encoding, &meaning, &spec, num_channels);
-			analog.meaning->channels = devc->enabled_analog_channels;
-			//analog.meaning->channels = num_channels;
-			analog.meaning->mq = SR_MQ_VOLTAGE;
-			analog.meaning->unit = SR_UNIT_VOLT;
-			analog.meaning->mqflags = 0 /* SR_MQFLAG_DC */;
-			analog.num_samples = pkt.num_samples;
-			analog.data = devc->analog_buffer;
-			encoding.is_float = true;
-
-	
-			sr_err("Enabled analog channels: %zu.", (size_t)devc->enabled_analog_channels);
-
-
-			const struct sr_datafeed_packet analog_packet = {
-				.type = SR_DF_ANALOG,
-				.payload = &analog
-			};
-
-
-			sr_err("num_samples=%u", analog.num_samples);
-			sr_err("num_channels=%u", num_channels);
-			sr_err("needed_bytes=%zu", needed_bytes);
-
-
-			sr_session_send(sdi, &analog_packet);
-
-			for (size_t s = 0; s < pkt.num_samples; s++) {
-				for (size_t ch = 0; ch < num_channels; ch++) {
-					float v = ((float*)devc->analog_buffer)[s * num_channels + ch];
-					printf("[FINAL] Sample[%zu] Channel[%zu] = %.3f V\n", s, ch, v);
-				}
-			}
-
-			
+		skip = sync_skip(devc, &pkt);
+		samples = pkt.digital_samples + skip;
+		num_samples = pkt.num_samples - skip;
+		parsed += num_samples;
+		while (num_samples) {
+			used = recorder_feed(devc, samples, num_samples);
+			samples += used;
+			num_samples -= used;
+			if (r->triggered && !r->remaining)
+				recorder_dump(sdi);
 		}
-		offset += parsed_len;
 	}
+
+	*consumed = offset;
+
+	return parsed;
 }
 
+/*
+ * Parse packets from the data and send up to max_samples of their samples.
+ * Returns the number of samples sent, the number of bytes parsed goes to
+ * *consumed.
+ */
+static uint64_t send_data(struct sr_dev_inst *sdi, uint8_t *data,
+	size_t length, uint64_t max_samples, size_t *consumed)
+{
+	struct dev_context *devc;
+	int64_t start_us;
+	uint64_t sent;
 
-// Testing function to send hardcoded data
-// static void mso_send_data_proc(struct sr_dev_inst *sdi,
-//     uint8_t *data, size_t length, size_t sample_width)
-// {
-//     struct sr_datafeed_analog analog;
-//     struct sr_analog_encoding encoding;
-//     struct sr_analog_meaning meaning;
-//     struct sr_analog_spec spec;
-//     struct dev_context *devc = sdi->priv;
-//     (void)sample_width;
+	devc = sdi->priv;
 
-//     sr_err("mso_send_data_proc started with fixed 8-channel test data");
+	if (!TRACE_ENABLED(devc)) {
+		sent = devc->send_data_proc(sdi, data, length, max_samples,
+			consumed);
+		devc->sync_sent += sent;
+		return sent;
+	}
 
-//     size_t num_channels = 8;
-//     size_t num_samples = 100;  
+	start_us = g_get_monotonic_time();
+	sent = devc->send_data_proc(sdi, data, length, max_samples, consumed);
+	trace_record(devc, TRACE_PARSE, 0, start_us, g_get_monotonic_time(),
+		*consumed);
+	devc->sync_sent += sent;
 
-//     size_t total_floats = num_channels * num_samples;
-//     size_t needed_bytes = total_floats * sizeof(float);
+	return sent;
+}
 
-//     if (needed_bytes > devc->analog_buffer_size) {
-//         devc->analog_buffer = g_realloc(devc->analog_buffer, needed_bytes);
-//         devc->analog_buffer_size = needed_bytes;
-//     }
+/* Samples still missing from the current frame. */
+static uint64_t remaining_samples(const struct dev_context *devc)
+{
+	if (!devc->limit_samples)
+		return UINT64_MAX;
+	if (devc->sent_samples >= devc->limit_samples)
+		return 0;
 
-//     float *buf = (float *)devc->analog_buffer;
+	return devc->limit_samples - devc->sent_samples;
+}
 
-//     // Fixed values per channel
-//     float channel_values[8] = {
-//         0.5f,
-//         1.0f,
-//         1.5f,
-//         2.0f,
-//         2.5f,
-//         3.0f,
-//         0.75f,
-//         2.25f
-//     };
+/*
+ * Run the send procs over the data of one transfer. They evaluate the
+ * soft trigger on the decoded samples and only emit once it has fired.
+ * The sample limit is accounted for in parsed samples, parsing stops as
+ * soon as the frame is complete and goes on with the next frame. When
+ * capturing segmented, the frames all go out once the last one is
+ * stored. The flight recorder sends its own frames and runs until it is
+ * stopped. Returns TRUE when the last requested frame is complete.
+ */
+static gboolean process_data(struct sr_dev_inst *sdi,
+	uint8_t *buf, size_t length)
+{
+	struct dev_context *devc;
+	uint64_t max_samples;
+	size_t processed, consumed;
+	gboolean frame_ended, final_frame;
 
-//     // Fill interleaved buffer: each sample in time has the 8 channel values
-//     for (size_t sample = 0; sample < num_samples; sample++) {
-//         for (size_t ch = 0; ch < num_channels; ch++) {
-//             buf[sample * num_channels + ch] = channel_values[ch];
-//         }
-//     }
+	devc = sdi->priv;
+	processed = 0;
+
+	if (devc->segments.num_slots) {
+		send_data(sdi, buf, length, UINT64_MAX, &consumed);
+		if (devc->segments.num_done < devc->segments.num_slots)
+			return FALSE;
+		segments_flush(sdi);
+		return TRUE;
+	}
+	if (devc->recorder.size) {
+		send_data(sdi, buf, length, UINT64_MAX, &consumed);
+		return FALSE;
+	}
 
-//     sr_analog_init(&analog, &encoding, &meaning, &spec, num_channels);
-//     analog.meaning->channels = devc->enabled_analog_channels;
-//     analog.meaning->mq = SR_MQ_VOLTAGE;
-//     analog.meaning->unit = SR_UNIT_VOLT;
-//     analog.meaning->mqflags = 0;
-//     analog.num_samples = num_samples;  // samples per channel
-//     analog.data = devc->analog_buffer;
+	while (processed < length) {
+		if ((max_samples = remaining_samples(devc))) {
+			devc->sent_samples += send_data(sdi, buf + processed,
+				length - processed, max_samples, &consumed);
+			processed += consumed;
+		}
+		if (devc->spill.failed)
+			return TRUE;
 
-//     const struct sr_datafeed_packet analog_packet = {
-//         .type = SR_DF_ANALOG,
-//         .payload = &analog
-//     };
+		frame_ended = (devc->limit_samples
+			&& devc->sent_samples >= devc->limit_samples)
+			|| devc->cstore.full;
+		if (!frame_ended)
+			break;
+		final_frame = devc->limit_frames
+			&& devc->num_frames >= devc->limit_frames - 1;
 
-//     sr_session_send(sdi, &analog_packet);
+		devc->num_frames++;
+		devc->sent_samples = 0;
+		devc->trigger_fired = FALSE;
+		cstore_flush(sdi);
+		analog_emit_flush(sdi);
+		logic_emit_flush(sdi);
+		std_session_send_df_frame_end(sdi);
+		if (final_frame)
+			return TRUE;
 
-//     // Print debug
-//     for (size_t i = 0; i < total_floats; i++) {
-//         printf("[FINAL] Sample[%zu] = %.3f V\n", i, buf[i]);
-//     }
-// }
+		/* Rearm the trigger, the remaining data may hold the next one. */
+		if (devc->stl || devc->analog_trigger.active) {
+			if (devc->stl)
+				devc->stl->cur_stage = 0;
+			analog_trigger_reset(&devc->analog_trigger);
+		} else {
+			std_session_send_df_frame_begin(sdi);
+			devc->trigger_fired = TRUE;
+		}
+	}
 
+	return FALSE;
+}
 
-static void la_send_data_proc(struct sr_dev_inst *sdi,
-	uint8_t *data, size_t length, size_t sample_width)
+/*
+ * Pause the device when the queue has filled up to the high watermark and
+ * resume it once the parser has caught up. This runs outside of the libusb
+ * callbacks, synchronous control transfers are not allowed in there.
+ */
+static void update_flow_control(struct sr_dev_inst *sdi)
 {
-	struct dev_context *devc = sdi->priv;
-	struct parsed_packet pkt;
-	(void)sample_width;
+	struct dev_context *devc;
+	struct transfer_queue *q;
+	int64_t now;
 
-	size_t offset = 0;
+	devc = sdi->priv;
+	q = &devc->queue;
 
-	sr_err("la_send_data_proc started ");
-	while (offset + HEADER_SIZE <= length) {
-		int parsed_len = fx3driver_parse_next_packet(&data[offset], length - offset, &pkt);
+	if (!q->flow_control || devc->acq_aborted)
+		return;
 
-		// if(parsed_len == -3){
-		// 	sr_err("Skipping to next packet %zu.", offset);
-		// 	continue;;
-		// }
-		if (parsed_len <= 0) {
-			sr_err("Invalid or incomplete packet at offset %zu.", offset);
-			break;
+	if (!q->paused && q->count >= q->high_watermark) {
+		if (command_flow_control(sdi, CMD_PAUSE) != SR_OK) {
+			sr_warn("Firmware lacks flow control, disabling it.");
+			q->flow_control = FALSE;
+			return;
 		}
-
-	// if it sees channel_type 0xFF send samples to digital channels
-	if (pkt.channel_type == 0xFF) {
-
-		int sample_width = 2; // Assuming 16-bit samples
-		size_t needed_bytes = pkt.num_samples * sample_width; // we are retriveing 4 samples, each sample is 2 bytes, so the toaotl length will be 4*2 = 8 bytes 
-		if (needed_bytes > devc->logic_buffer_size) {
-			devc->logic_buffer = g_realloc(devc->logic_buffer, needed_bytes);
-			devc->logic_buffer_size = needed_bytes;
+		q->paused = TRUE;
+		q->pause_start_us = g_get_monotonic_time();
+		q->num_pauses++;
+		sr_dbg("Paused streaming at %u queued transfers.", q->count);
+	} else if (q->paused && q->count <= q->low_watermark && !q->num_held) {
+		if (command_flow_control(sdi, CMD_RESUME) != SR_OK) {
+			/* The device would stay paused forever. */
+			cypress_fx3_abort_acquisition(devc);
+			return;
 		}
+		now = g_get_monotonic_time();
+		q->paused = FALSE;
+		q->paused_us += now - q->pause_start_us;
+		q->num_resumes++;
+		sr_dbg("Resumed streaming at %u queued transfers.", q->count);
+	}
+}
 
-		memcpy(devc->logic_buffer, pkt.digital_samples, pkt.num_samples * sizeof(uint16_t));
+/*
+ * Feed queued transfers to the parser. After the profile's drain budget
+ * the USB events get their turn again, unless transfers are held back
+ * and the device is stalled waiting for us.
+ */
+static void drain_queue(struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+	struct transfer_queue *q;
+	struct libusb_transfer *transfer;
+	int64_t deadline;
 
-		const struct sr_datafeed_logic logic = {
-			.length = needed_bytes,
-			.unitsize = 2,
-			.data = devc->logic_buffer
-		};
+	devc = sdi->priv;
+	q = &devc->queue;
+	deadline = g_get_monotonic_time() +
+		acq_profiles[devc->acq_profile].drain_budget_ms * 1000;
 
-		const struct sr_datafeed_packet logic_packet = {
-			.type = SR_DF_LOGIC,
-			.payload = &logic
-		};
+	update_flow_control(sdi);
 
-		sr_session_send(sdi, &logic_packet);
+	while (q->count && !devc->acq_aborted) {
+		if (!q->num_held && g_get_monotonic_time() > deadline)
+			break;
+		if (sync_ahead(devc))
+			break;
 
-		// Print final samples to ensure they match the expected values
-		for (size_t i = 0; i < pkt.num_samples; i++) {
-			printf("[FINAL] Sample[%zu] = 0x%04X\n", i, ((uint16_t *)devc->logic_buffer)[i]);
+		transfer = pop_transfer(q);
+		q->idle[q->num_idle++] = transfer;
+		if (process_data(sdi, transfer->buffer, transfer->actual_length)) {
+			/*
+			 * All requested samples are out. Tell the session
+			 * right away instead of after the transfers still
+			 * in flight have been cancelled.
+			 */
+			std_session_send_df_end(sdi);
+			devc->end_sent = TRUE;
+			cypress_fx3_abort_acquisition(devc);
+			break;
 		}
 
+		if (q->num_held) {
+			push_transfer(q, q->held[0]);
+			q->num_held--;
+			memmove(&q->held[0], &q->held[1],
+				q->num_held * sizeof(q->held[0]));
+			submit_idle_transfer(devc);
+		}
 	}
 
-
-		offset += parsed_len;
-	
-	}
+	update_flow_control(sdi);
 }
 
 static void LIBUSB_CALL receive_transfer(struct libusb_transfer *transfer)
@@ -773,40 +3456,28 @@ static void LIBUSB_CALL receive_transfer(struct libusb_transfer *transfer)
 	struct sr_dev_inst *sdi;
 	struct dev_context *devc;
 	gboolean packet_has_error = FALSE;
-	unsigned int num_samples;
-	int trigger_offset, cur_sample_count, unitsize, processed_samples;
-	int pre_trigger_samples;
 
 	sdi = transfer->user_data;
 	devc = sdi->priv;
 
+	trace_completed(devc, transfer);
+
 	/*
 	 * If acquisition has already ended, just free any queued up
 	 * transfer that come in.
 	 */
 	if (devc->acq_aborted) {
-		free_transfer(transfer);
+		release_transfer(transfer);
 		return;
 	}
 
-	sr_err("receive_transfer(): status %s received %d bytes.",
+	sr_spew("receive_transfer(): status %s received %d bytes.",
 		libusb_error_name(transfer->status), transfer->actual_length);
 
-
-
-
-	/* Save incoming transfer before reusing the transfer struct. */
-	//unitsize = devc->sample_wide ? 2 : 1;
-	unitsize = 1; // 16-bit samples
-	cur_sample_count = transfer->actual_length / unitsize;
-	processed_samples = 0;
-
-
-
 	switch (transfer->status) {
 	case LIBUSB_TRANSFER_NO_DEVICE:
 		cypress_fx3_abort_acquisition(devc);
-		free_transfer(transfer);
+		release_transfer(transfer);
 		return;
 	case LIBUSB_TRANSFER_COMPLETED:
 	case LIBUSB_TRANSFER_TIMED_OUT: /* We may have received some data though. */
@@ -816,6 +3487,26 @@ static void LIBUSB_CALL receive_transfer(struct libusb_transfer *transfer)
 		break;
 	}
 
+	if (transfer->actual_length == 0 && !packet_has_error
+			&& transfer->status == LIBUSB_TRANSFER_TIMED_OUT
+			&& acq_profiles[devc->acq_profile].flush_ms) {
+		/* Nothing arrived before the flush deadline, that is fine. */
+		resubmit_transfer(transfer);
+		return;
+	}
+
+	/*
+	 * Streaming is paused, the transfers in flight time out empty and
+	 * say nothing about the device. Neither count nor reset them.
+	 */
+	if (devc->queue.paused && !packet_has_error) {
+		if (transfer->actual_length == 0)
+			resubmit_transfer(transfer);
+		else
+			queue_transfer(devc, transfer);
+		return;
+	}
+
 	if (transfer->actual_length == 0 || packet_has_error) {
 		devc->empty_transfer_count++;
 		if (devc->empty_transfer_count > MAX_EMPTY_TRANSFERS) {
@@ -824,7 +3515,7 @@ static void LIBUSB_CALL receive_transfer(struct libusb_transfer *transfer)
 			 * will work out that the samplecount is short.
 			 */
 			cypress_fx3_abort_acquisition(devc);
-			free_transfer(transfer);
+			release_transfer(transfer);
 		} else {
 			resubmit_transfer(transfer);
 		}
@@ -833,76 +3524,9 @@ static void LIBUSB_CALL receive_transfer(struct libusb_transfer *transfer)
 		devc->empty_transfer_count = 0;
 	}
 
-check_trigger:
-	if (devc->trigger_fired) {
-		if (!devc->limit_samples || devc->sent_samples < devc->limit_samples) {
-			/* Send the incoming transfer to the session bus. */
-			num_samples = cur_sample_count - processed_samples;
-			if (devc->limit_samples && devc->sent_samples + num_samples > devc->limit_samples)
-				num_samples = devc->limit_samples - devc->sent_samples;
-
-			devc->send_data_proc(sdi, (uint8_t *)transfer->buffer + processed_samples * unitsize,
-				num_samples * unitsize, unitsize);
-			devc->sent_samples += num_samples;
-			processed_samples += num_samples;
-		}
-	} else {
-		trigger_offset = soft_trigger_logic_check(devc->stl,
-			transfer->buffer + processed_samples * unitsize,
-			transfer->actual_length - processed_samples * unitsize,
-			&pre_trigger_samples);
-		if (trigger_offset > -1) {
-			std_session_send_df_frame_begin(sdi);
-			devc->sent_samples += pre_trigger_samples;
-			num_samples = cur_sample_count - processed_samples - trigger_offset;
-			if (devc->limit_samples &&
-					devc->sent_samples + num_samples > devc->limit_samples)
-				num_samples = devc->limit_samples - devc->sent_samples;
-
-			devc->send_data_proc(sdi, (uint8_t *)transfer->buffer
-					+ processed_samples * unitsize
-					+ trigger_offset * unitsize,
-					num_samples * unitsize, unitsize);
-			devc->sent_samples += num_samples;
-			processed_samples += trigger_offset + num_samples;
-
-			devc->trigger_fired = TRUE;
-		}
-	}
-
-	const int frame_ended = devc->limit_samples && (devc->sent_samples >= devc->limit_samples);
-	const int final_frame = devc->limit_frames && (devc->num_frames >= (devc->limit_frames - 1));
-
-	if (frame_ended) {
-		devc->num_frames++;
-		devc->sent_samples = 0;
-		devc->trigger_fired = FALSE;
-		std_session_send_df_frame_end(sdi);
-
-		/* There may be another trigger in the remaining data, go back and check for it */
-		if (processed_samples < cur_sample_count) {
-			/* Reset the trigger stage */
-			if (devc->stl)
-				devc->stl->cur_stage = 0;
-			else {
-				std_session_send_df_frame_begin(sdi);
-				devc->trigger_fired = TRUE;
-			}
-			if (!final_frame)
-				goto check_trigger;
-		}
-	}
-	if (frame_ended && final_frame) {
-		cypress_fx3_abort_acquisition(devc);
-		free_transfer(transfer);
-	} else
-		resubmit_transfer(transfer);
+	queue_transfer(devc, transfer);
 }
 
-
-
-
-
 static int configure_channels(const struct sr_dev_inst *sdi)
 {
 	struct dev_context *devc;
@@ -927,6 +3551,7 @@ static int configure_channels(const struct sr_dev_inst *sdi)
 			channel_mask |= ch->enabled << p;
 		}
 	}
+	devc->logic_unitsize = (channel_mask & 0xff00) ? 2 : 1;
 
 	/*
 	 * Use wide sampling as default for now #TODO
@@ -946,10 +3571,11 @@ static size_t get_buffer_size(struct dev_context *devc)
 	size_t s;
 
 	/*
-	 * The buffer should be large enough to hold 10ms of data and
-	 * a multiple of 512.
+	 * The buffer should be large enough to hold the profile's amount
+	 * of data (10ms for throughput) and a multiple of 512.
 	 */
-	s = 10 * to_bytes_per_ms(devc->cur_samplerate);
+	s = acq_profiles[devc->acq_profile].buffer_ms *
+		to_bytes_per_ms(devc->cur_samplerate);
 	return (s + 1023) & ~1023;
 }
 
@@ -957,12 +3583,17 @@ static unsigned int get_number_of_transfers(struct dev_context *devc)
 {
 	unsigned int n;
 
-	/* Total buffer size should be able to hold about 500ms of data. */
-	n = (500 * to_bytes_per_ms(devc->cur_samplerate) /
-		get_buffer_size(devc));
+	/*
+	 * Total buffer size should be able to hold the profile's amount of
+	 * data in flight (about 500ms for throughput).
+	 */
+	n = (acq_profiles[devc->acq_profile].in_flight_ms *
+		to_bytes_per_ms(devc->cur_samplerate) / get_buffer_size(devc));
 
 	if (n > NUM_SIMUL_TRANSFERS)
 		return NUM_SIMUL_TRANSFERS;
+	if (n < 1)
+		return 1;
 
 	return n;
 }
@@ -972,6 +3603,10 @@ static unsigned int get_timeout(struct dev_context *devc)
 	size_t total_size;
 	unsigned int timeout;
 
+	/* Partially filled transfers come back at the flush deadline. */
+	if (acq_profiles[devc->acq_profile].flush_ms)
+		return acq_profiles[devc->acq_profile].flush_ms;
+
 	total_size = get_buffer_size(devc) *
 			get_number_of_transfers(devc);
 	timeout = total_size / to_bytes_per_ms(devc->cur_samplerate);
@@ -981,83 +3616,324 @@ static unsigned int get_timeout(struct dev_context *devc)
 static int receive_data(int fd, int revents, void *cb_data)
 {
 	struct timeval tv;
+	struct sr_dev_inst *sdi;
+	struct dev_context *devc;
 	struct drv_context *drvc;
 
 	(void)fd;
 	(void)revents;
 
-	drvc = (struct drv_context *)cb_data;
+	sdi = cb_data;
+	devc = sdi->priv;
+	drvc = sdi->driver->context;
+
+	/* Only now is it known which thread runs the acquisition. */
+	if (G_UNLIKELY(!devc->tuning_done)) {
+		thread_tuning_apply(devc);
+		devc->tuning_done = TRUE;
+	}
+
+	if (devc->mock) {
+		cypress_fx3_mock_handle_events(devc->mock);
+	} else {
+		tv.tv_sec = tv.tv_usec = 0;
+		libusb_handle_events_timeout(drvc->sr_ctx->libusb_ctx, &tv);
+	}
+
+	drain_queue(sdi);
 
-	tv.tv_sec = tv.tv_usec = 0;
-	libusb_handle_events_timeout(drvc->sr_ctx->libusb_ctx, &tv);
+	if (devc->limit_msec && !devc->acq_aborted && g_get_monotonic_time()
+			- devc->acq_start_us >= (int64_t)devc->limit_msec * 1000) {
+		sr_dbg("Time limit of %" PRIu64 "ms reached.", devc->limit_msec);
+		cypress_fx3_abort_acquisition(devc);
+	}
 
 	return TRUE;
 }
 
+/*
+ * Make sure the transfer pool matches the requested geometry. The libusb
+ * transfers survive across acquisitions, they only get thrown away and
+ * reallocated when their number changes. Next to the transfers in
+ * flight, the pool holds one spare transfer for every slot of the queue.
+ * The queue and the transfer buffers are carved from the arena.
+ */
+static int alloc_transfers(struct dev_context *devc,
+	unsigned int num_transfers, unsigned int queue_depth, size_t size)
+{
+	struct libusb_transfer *transfer;
+	struct arena *a;
+	unsigned int i, total;
+
+	a = &devc->arena;
+	total = num_transfers + queue_depth;
+	if (devc->transfers && devc->num_transfers == total) {
+		sr_dbg("Reusing %u pooled transfers.", total);
+	} else {
+		free_transfers(devc);
+		devc->transfers = g_try_malloc0(sizeof(*devc->transfers) * total);
+		if (!devc->transfers) {
+			sr_err("USB transfers malloc failed.");
+			return SR_ERR_MALLOC;
+		}
+		devc->num_transfers = total;
+		for (i = 0; i < total; i++) {
+			if (!(transfer = libusb_alloc_transfer(0))) {
+				sr_err("USB transfer malloc failed.");
+				free_transfers(devc);
+				return SR_ERR_MALLOC;
+			}
+			devc->transfers[i] = transfer;
+		}
+	}
+
+	devc->queue.ring = arena_alloc(a, sizeof(*devc->queue.ring) * queue_depth);
+	devc->queue.idle = arena_alloc(a, sizeof(*devc->queue.idle) * total);
+	devc->queue.held = arena_alloc(a, sizeof(*devc->queue.held) * total);
+	if (!devc->queue.ring || !devc->queue.idle || !devc->queue.held)
+		return SR_ERR_MALLOC;
+	devc->queue.depth = queue_depth;
+	devc->transfer_buffer_size = size;
+
+	for (i = 0; i < total; i++) {
+		if (!(devc->transfers[i]->buffer = arena_alloc(a, size)))
+			return SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * A staging buffer holds what the emitter of the data path in use
+ * gathers: analog values for mso_send_data_proc(), or logic samples of
+ * up to 16 bits for la_send_data_proc(). The other buffer is not needed.
+ */
+static void staging_sizes(const struct dev_context *devc,
+	size_t *logic_size, size_t *analog_size)
+{
+	if (g_slist_length(devc->enabled_analog_channels) > 0) {
+		*logic_size = 0;
+		*analog_size = sizeof(float) * ANALOG_PACKET_CHANNELS
+			* MAX(ANALOG_PACKET_SAMPLES,
+			acq_profiles[devc->acq_profile].emit_analog);
+	} else {
+		*logic_size = sizeof(uint16_t)
+			* acq_profiles[devc->acq_profile].emit_logic;
+		*analog_size = 0;
+	}
+}
+
+/* Decoded logic samples of a packet, repacked for the soft trigger. */
+static size_t trigger_buffer_size(const struct dev_context *devc)
+{
+	return devc->stl ? LOGIC_PACKET_SAMPLES * devc->stl->unitsize : 0;
+}
+
+static size_t analog_ring_size(const struct dev_context *devc)
+{
+	return devc->analog_trigger.ring_size * ANALOG_PACKET_CHANNELS
+		* sizeof(float);
+}
+
+static size_t segment_table_size(const struct dev_context *devc)
+{
+	return devc->segments.num_slots * sizeof(struct segment);
+}
+
+/* Carve the buffers between the parser and the session bus. */
+static int alloc_staging(struct dev_context *devc)
+{
+	struct arena *a;
+	size_t logic_size, analog_size;
+
+	a = &devc->arena;
+	staging_sizes(devc, &logic_size, &analog_size);
+	devc->logic_buffer = arena_alloc(a, logic_size);
+	devc->logic_buffer_size = devc->logic_buffer ? logic_size : 0;
+	devc->analog_buffer = arena_alloc(a, analog_size);
+	devc->analog_buffer_size = devc->analog_buffer ? analog_size : 0;
+	devc->packet_values = arena_alloc(a,
+		sizeof(float) * ANALOG_PACKET_VALUES);
+	devc->packet_samples = arena_alloc(a,
+		sizeof(uint16_t) * LOGIC_PACKET_SAMPLES);
+	devc->trigger_buffer = arena_alloc(a, trigger_buffer_size(devc));
+	devc->analog_trigger.ring = arena_alloc(a, analog_ring_size(devc));
+	devc->segments.slots = arena_alloc(a, segments_size(devc));
+	devc->segments.segments = arena_alloc(a, segment_table_size(devc));
+	devc->recorder.ring = arena_alloc(a, recorder_ring_size(devc));
+	devc->spill.block = arena_alloc(a, spill_block_size(devc));
+	devc->cstore.data = arena_alloc(a, cstore_data_size(devc));
+	devc->cstore.index = arena_alloc(a, cstore_index_size(devc));
+	devc->cstore.block = arena_alloc(a, cstore_block_size(devc));
+	if (!devc->logic_buffer || !devc->analog_buffer || !devc->packet_values
+			|| !devc->packet_samples || !devc->trigger_buffer
+			|| !devc->analog_trigger.ring
+			|| !devc->segments.slots || !devc->segments.segments
+			|| !devc->recorder.ring || !devc->spill.block
+			|| !devc->cstore.data || !devc->cstore.index
+			|| !devc->cstore.block)
+		return SR_ERR_MALLOC;
+
+	sr_dbg("Staging buffers: %zu bytes logic, %zu bytes analog.",
+	       logic_size, analog_size);
+
+	return SR_OK;
+}
+
+/* What alloc_transfers() and alloc_staging() carve from the arena. */
+static size_t acquisition_arena_size(const struct dev_context *devc,
+	unsigned int num_transfers, size_t size)
+{
+	unsigned int total;
+	size_t logic_size, analog_size;
+
+	total = num_transfers + devc->queue_depth;
+	staging_sizes(devc, &logic_size, &analog_size);
+
+	return arena_size(sizeof(struct libusb_transfer *) * devc->queue_depth)
+		+ 2 * arena_size(sizeof(struct libusb_transfer *) * total)
+		+ total * arena_size(size)
+		+ arena_size(logic_size) + arena_size(analog_size)
+		+ arena_size(sizeof(float) * ANALOG_PACKET_VALUES)
+		+ arena_size(sizeof(uint16_t) * LOGIC_PACKET_SAMPLES)
+		+ arena_size(trigger_buffer_size(devc))
+		+ arena_size(analog_ring_size(devc))
+		+ arena_size(segments_size(devc))
+		+ arena_size(segment_table_size(devc))
+		+ arena_size(recorder_ring_size(devc))
+		+ arena_size(spill_block_size(devc))
+		+ arena_size(cstore_data_size(devc))
+		+ arena_size(cstore_index_size(devc))
+		+ arena_size(cstore_block_size(devc));
+}
+
 static int start_transfers(const struct sr_dev_inst *sdi)
 {
 	struct dev_context *devc;
+	struct analog_trigger *at;
 	struct sr_usb_dev_inst *usb;
 	struct sr_trigger *trigger;
 	struct libusb_transfer *transfer;
+	struct transfer_queue *q;
 	unsigned int i, num_transfers;
 	int timeout, ret;
-	unsigned char *buf;
-	size_t size;
+	size_t size, arena_needed;
 
 	devc = sdi->priv;
 	usb = sdi->conn;
 
 	devc->sent_samples = 0;
 	devc->acq_aborted = FALSE;
+	devc->end_sent = FALSE;
+	devc->tuning_done = FALSE;
 	devc->empty_transfer_count = 0;
 
+	/* The analog trigger needs analog data, i.e. the mso data path. */
+	at = &devc->analog_trigger;
+	at->active = at->source >= 0
+		&& g_slist_length(devc->enabled_analog_channels) > 0;
+	at->ring_size = at->active && devc->limit_samples > 0 ?
+		(devc->capture_ratio * devc->limit_samples) / 100 : 0;
+	if (at->ring_size > ANALOG_RING_MEMORY_MAX / ANALOG_PACKET_CHANNELS
+			/ sizeof(float)) {
+		at->ring_size = ANALOG_RING_MEMORY_MAX / ANALOG_PACKET_CHANNELS
+			/ sizeof(float);
+		sr_warn("Analog pre-trigger data cut down to %zu samples.",
+			at->ring_size);
+	}
+	analog_trigger_reset(at);
+
 	if ((trigger = sr_session_trigger_get(sdi->session))) {
 		int pre_trigger_samples = 0;
-		if (devc->limit_samples > 0)
+		/* The soft trigger sends these itself, not into the file. */
+		if (devc->limit_samples > 0 && !spill_wanted(devc))
 			pre_trigger_samples = (devc->capture_ratio * devc->limit_samples) / 100;
 		devc->stl = soft_trigger_logic_new(sdi, trigger, pre_trigger_samples);
 		if (!devc->stl)
 			return SR_ERR_MALLOC;
+		soft_trigger_prefilter_init(&devc->prefilter, devc->stl);
+		devc->trigger_fired = FALSE;
+	} else if (at->active) {
 		devc->trigger_fired = FALSE;
 	} else {
-		std_session_send_df_frame_begin(sdi);
 		devc->trigger_fired = TRUE;
 	}
 
+	devc->analog_emitter.fill = 0;
+	devc->analog_emitter.flush_samples = MAX(ANALOG_PACKET_SAMPLES,
+		acq_profiles[devc->acq_profile].emit_analog);
+	devc->analog_emitter.flush_us =
+		acq_profiles[devc->acq_profile].emit_ms * 1000;
+	devc->logic_emitter.fill = 0;
+	devc->logic_emitter.flush_samples =
+		acq_profiles[devc->acq_profile].emit_logic;
+	devc->logic_emitter.flush_us = devc->analog_emitter.flush_us;
+	/* The soft trigger sends the pre-trigger samples in its unit size. */
+	if (devc->stl)
+		devc->logic_unitsize = devc->stl->unitsize;
+
+	/* Segmented and recorded frames begin when they are sent. */
+	segments_init(devc);
+	recorder_init(devc);
+	if ((ret = spill_open(devc)) != SR_OK)
+		return ret;
+	cstore_init(devc);
+	if (devc->trigger_fired && !devc->segments.num_slots
+			&& !devc->recorder.size)
+		std_session_send_df_frame_begin(sdi);
+
 	num_transfers = get_number_of_transfers(devc);
 
 	size = get_buffer_size(devc);
 	sr_info("num_transfers: %d, buffer_size: %zu", num_transfers,size);
 	devc->submitted_transfers = 0;
 
-	devc->transfers = g_try_malloc0(sizeof(*devc->transfers) * num_transfers);
-	if (!devc->transfers) {
-		sr_err("USB transfers malloc failed.");
-		return SR_ERR_MALLOC;
+	arena_needed = acquisition_arena_size(devc, num_transfers, size);
+	if ((ret = arena_begin(&devc->arena, arena_needed,
+			devc->mem_flags)) != SR_OK)
+		return ret;
+	if ((ret = alloc_transfers(devc, num_transfers, devc->queue_depth,
+			size)) != SR_OK || (ret = alloc_staging(devc)) != SR_OK)
+		return ret;
+	/* Both must list the same buffers, or the arena is sized wrong. */
+	if (devc->arena.used != arena_needed) {
+		sr_err("Arena sized for %zu bytes, %zu bytes carved.",
+		       arena_needed, devc->arena.used);
+		return SR_ERR_BUG;
 	}
 
+	q = &devc->queue;
+	q->head = q->count = q->num_held = q->num_idle = 0;
+	q->decimation_phase = q->max_fill = 0;
+	q->num_blocked = q->num_dropped_oldest = 0;
+	q->num_dropped_newest = q->num_decimated = 0;
+	q->flow_control = devc->overflow_policy == OVERFLOW_BLOCK;
+	q->paused = FALSE;
+	q->high_watermark = MAX((q->depth * 3) / 4, 1);
+	q->low_watermark = q->depth / 4;
+	q->paused_us = 0;
+	q->num_pauses = q->num_resumes = 0;
+
+	trace_start(devc);
+
 	timeout = get_timeout(devc);
-	devc->num_transfers = num_transfers;
-	for (i = 0; i < num_transfers; i++) {
-		if (!(buf = g_try_malloc(size))) {
-			sr_err("USB transfer buffer malloc failed.");
-			return SR_ERR_MALLOC;
-		}
-		transfer = libusb_alloc_transfer(0);
+	for (i = 0; i < devc->num_transfers; i++) {
+		transfer = devc->transfers[i];
 		libusb_fill_bulk_transfer(transfer, usb->devhdl,
-				2 | LIBUSB_ENDPOINT_IN, buf, size,
+				2 | LIBUSB_ENDPOINT_IN, transfer->buffer, size,
 				receive_transfer, (void *)sdi, timeout);
+		if (i >= num_transfers) {
+			/* Spare transfers for the queue. */
+			q->idle[q->num_idle++] = transfer;
+			continue;
+		}
 		sr_info("submitting transfer: %d", i);
-		if ((ret = libusb_submit_transfer(transfer)) != 0) {
+		if ((ret = submit_transfer(devc, transfer)) != 0) {
 			sr_err("Failed to submit transfer: %s.",
 			       libusb_error_name(ret));
-			libusb_free_transfer(transfer);
-			g_free(buf);
 			cypress_fx3_abort_acquisition(devc);
 			return SR_ERR;
 		}
-		devc->transfers[i] = transfer;
 		devc->submitted_transfers++;
 	}
 
@@ -1067,10 +3943,14 @@ static int start_transfers(const struct sr_dev_inst *sdi)
 	 * data. Otherwise use la_send_data_proc().
 	 */
 	if (g_slist_length(devc->enabled_analog_channels) > 0){
-		sr_err("Using mso_send_data_proc for analog channels.");
+		sr_dbg("Using mso_send_data_proc for analog channels.");
 		devc->send_data_proc = mso_send_data_proc;
+	}else if (devc->segments.num_slots) {
+		devc->send_data_proc = segment_send_data_proc;
+	}else if (devc->recorder.size) {
+		devc->send_data_proc = recorder_send_data_proc;
 	}else{
-		sr_err("Using la_send_data_proc for logic channels.");	
+		sr_dbg("Using la_send_data_proc for logic channels.");
 		devc->send_data_proc = la_send_data_proc;
 	}
 	std_session_send_df_header(sdi);
@@ -1084,7 +3964,6 @@ SR_PRIV int cypress_fx3_start_acquisition(const struct sr_dev_inst *sdi)
 	struct drv_context *drvc;
 	struct dev_context *devc;
 	int timeout, ret;
-	size_t size;
 
 	di = sdi->driver;
 	drvc = di->context;
@@ -1096,29 +3975,42 @@ SR_PRIV int cypress_fx3_start_acquisition(const struct sr_dev_inst *sdi)
 	devc->empty_transfer_count = 0;
 	devc->acq_aborted = FALSE;
 
+	/* Join first, any failure from here on cancels the sync group. */
+	sync_group_join(sdi);
+
 	if (configure_channels(sdi) != SR_OK) {
 		sr_err("Failed to configure channels.");
+		sync_group_leave(sdi);
 		return SR_ERR;
 	}
 
 	timeout = get_timeout(devc);
 
-	usb_source_add(sdi->session, devc->ctx, timeout, receive_data, drvc);
-
-	size = get_buffer_size(devc);
-
-	
-	/* Prepare for analog sampling. */
-	if (g_slist_length(devc->enabled_analog_channels) > 0) {
-		/* We need a buffer half the size of a transfer. */
-		devc->logic_buffer = g_try_malloc(size);
-		devc->analog_buffer = g_try_malloc(sizeof(float) * size );
+	if (devc->mock)
+		sr_session_source_add(sdi->session, -1, 0, MOCK_POLL_MS,
+			receive_data, (void *)sdi);
+	else
+		usb_source_add(sdi->session, devc->ctx, timeout, receive_data,
+			(void *)sdi);
+
+	if ((ret = start_transfers(sdi)) != SR_OK) {
+		/* An abort after submitting has wrapped up and left already. */
+		if (!devc->acq_aborted) {
+			if (devc->mock)
+				sr_session_source_remove(sdi->session, -1);
+			else
+				usb_source_remove(sdi->session, devc->ctx);
+			sync_group_leave(sdi);
+		}
+		return ret;
 	}
-	start_transfers(sdi);
-	if ((ret = command_start_acquisition(sdi)) != SR_OK) {
+	if (devc->mem_flags)
+		report_mem_region("Acquisition arena", &devc->arena.region);
+	if ((ret = sync_group_start(sdi)) != SR_OK) {
 		cypress_fx3_abort_acquisition(devc);
 		return ret;
 	}
+	devc->acq_start_us = g_get_monotonic_time();
 
 	return SR_OK;
 }
\ No newline at end of file
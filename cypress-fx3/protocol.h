@@ -29,6 +29,7 @@
 #include <libusb.h>
 #include <libsigrok/libsigrok.h>
 #include "libsigrok-internal.h"
+#include "soft-trigger-prefilter.h"
 
 #define LOG_PREFIX "cypress-fx3"
 
@@ -37,8 +38,57 @@
 #define NUM_TRIGGER_STAGES	4
 
 #define MAX_RENUM_DELAY_MS	3000
+/* Fallback poll interval while waiting for re-enumeration. */
+#define RENUM_POLL_MS		100
 #define NUM_SIMUL_TRANSFERS	16
 #define MAX_EMPTY_TRANSFERS	(NUM_SIMUL_TRANSFERS * 2)
+/* How long closing waits for cancelled transfers to come back. */
+#define DRAIN_TIMEOUT_MS	1000
+
+/* Completed transfers waiting for the parser, see struct transfer_queue. */
+#define DEFAULT_QUEUE_DEPTH	NUM_SIMUL_TRANSFERS
+#define MAX_QUEUE_DEPTH		256
+
+/* Transfer timeline tracing, see trace_start(). */
+#define TRACE_MAX_EVENTS	(1 << 18)
+#define TRACE_ENABLED(devc)	G_UNLIKELY((devc)->trace != NULL)
+
+/* Poll interval of the mock device's event source. */
+#define MOCK_POLL_MS		1
+
+/* Backing of the transfer and sample buffers, see mem_region_alloc(). */
+#define HUGE_PAGE_SIZE		(2 * 1024 * 1024)
+
+/* Alignment of every arena allocation, one cache line. */
+#define ARENA_ALIGN		64
+
+/* Samples the analog trigger compares per step. */
+#define ANALOG_SCAN_BLOCK	8
+/* Largest pre-trigger ring of the analog trigger. */
+#define ANALOG_RING_MEMORY_MAX	(256 * 1024 * 1024)
+/* Default band of the analog trigger in volts, around mid-scale. */
+#define ANALOG_TRIGGER_LOW	1.55
+#define ANALOG_TRIGGER_HIGH	1.75
+/* Largest segment store, larger captures send frames as they come. */
+#define SEGMENT_MEMORY_MAX	(512 * 1024 * 1024)
+/* Largest flight recorder window, longer windows are cut down. */
+#define RECORDER_MEMORY_MAX	(1024 * 1024 * 1024)
+
+/* Capture file layout, see struct spill_store. */
+#define SPILL_MAGIC		"FX3SPILL"
+#define SPILL_VERSION		1
+#define SPILL_HEADER_SIZE	(64 * 1024)
+#define SPILL_BLOCK_SAMPLES	(64 * 1024)
+/* Bytes of the capture file mapped at a time. */
+#define SPILL_WINDOW_SIZE	(64 * 1024 * 1024)
+
+/* Samples per block of the compressed store. */
+#define CSTORE_BLOCK_SAMPLES	4096
+/* Largest memory budget of the compressed store. */
+#define CSTORE_MEMORY_MAX	(256 * 1024 * 1024)
+
+/* How far a device of a sync group may run ahead of the slowest one. */
+#define SYNC_MAX_SKEW_US	20000
 
 #define NUM_CHANNELS		8  // was 16 channels
 
@@ -61,6 +111,8 @@
 #define CMD_GET_FW_VERSION		    (0xb0)
 #define CMD_START			        (0xb1)
 #define CMD_GET_REVID_VERSION		(0xb2)
+#define CMD_PAUSE			(0xb3)
+#define CMD_RESUME			(0xb4)
 
 #define CMD_START_FLAGS_CLK_CTL2_POS	4
 #define CMD_START_FLAGS_WIDE_POS	5
@@ -74,6 +126,32 @@
 #define CMD_START_FLAGS_CLK_48MHZ	(1 << CMD_START_FLAGS_CLK_SRC_POS)
 #define CMD_START_FLAGS_CLK_100MHZ	(2 << CMD_START_FLAGS_CLK_SRC_POS)
 
+/* Packet format */
+#define PREAMBLE		0xABCD
+#define HEADER_SIZE		16	/* Up to start of Sample[0] */
+#define MAX_PACKET_SIZE		1024
+/* Header plus checksum. */
+#define PACKET_OVERHEAD		18
+/* An analog packet holds 2 samples of each of 8 channels. */
+#define ANALOG_PACKET_CHANNELS	8
+#define ANALOG_PACKET_SAMPLES	2
+#define ANALOG_PACKET_VALUES	(ANALOG_PACKET_CHANNELS * ANALOG_PACKET_SAMPLES)
+/* 16 bit samples in the largest digital packet. */
+#define LOGIC_PACKET_SAMPLES	((MAX_PACKET_SIZE - PACKET_OVERHEAD) / 2)
+
+#pragma pack(push, 1)
+
+struct version_info {
+	uint8_t major;
+	uint8_t minor;
+};
+
+struct cmd_start_acquisition {
+	uint16_t sampling_factor;
+};
+
+#pragma pack(pop)
+
 
 struct cypress_fx3_profile {
 	uint16_t vid;
@@ -91,6 +169,385 @@ struct cypress_fx3_profile {
 	const char *usb_product;
 };
 
+/*
+ * Configuration keys of this driver which have no standard equivalent,
+ * numbered past the core's key ranges. Like every key they need an entry
+ * in the core's key info table, see sr_key_info_get(), for their name
+ * and data type.
+ */
+enum fx3_configkey {
+	/* Depth of the transfer queue, uint64. */
+	FX3_CONF_QUEUE_DEPTH = 70000,
+	/* What to do when the transfer queue is full, string. */
+	FX3_CONF_OVERFLOW_POLICY,
+	/* Overflow counters of the last acquisition, a{st}, read only. */
+	FX3_CONF_OVERFLOW_COUNTERS,
+	/* Acquisition profile, string, see enum acq_profile. */
+	FX3_CONF_ACQ_PROFILE,
+	/* Transfer timeline trace, string, see trace_start(). */
+	FX3_CONF_TRACE_FILE,
+	/* Scan options of the mock device, see mock.c. */
+	/* Capture to replay, string. */
+	FX3_CONF_MOCK_FILE,
+	/* Replay rate in bytes per second, uint64, 0 is unthrottled. */
+	FX3_CONF_MOCK_RATE,
+	/* Completion latency of every transfer in us, uint64. */
+	FX3_CONF_MOCK_LATENCY,
+	/* Placement of the acquisition thread, see thread_tuning_apply(). */
+	/* CPUs to pin to, string like "2,4-5", empty for any. */
+	FX3_CONF_CPUS,
+	/* NUMA node whose CPUs to pin to, int32, -1 for any. */
+	FX3_CONF_NUMA_NODE,
+	/* SCHED_FIFO priority, int32, 0 keeps the scheduling policy. */
+	FX3_CONF_RT_PRIORITY,
+	/* Backing of the buffers, string, see enum mem_flags. */
+	FX3_CONF_MEMORY,
+	/* Band of the analog trigger in volts, (dd), see analog_trigger_scan(). */
+	FX3_CONF_TRIGGER_BAND,
+	/* Flight recorder window in ms, uint64, see struct flight_recorder. */
+	FX3_CONF_RECORDER_WINDOW,
+	/* Deep capture file, string, see struct spill_store. */
+	FX3_CONF_SPILL_FILE,
+	/* Memory for compressed frames in bytes, uint64, 0 is off. */
+	FX3_CONF_COMPRESS_MEMORY,
+};
+
+/* Acquisition profiles, trading throughput against latency. */
+enum acq_profile {
+	/* Large transfers and heavy batching. */
+	PROFILE_THROUGHPUT,
+	/* Small transfers, a flush deadline and immediate emission. */
+	PROFILE_LATENCY,
+};
+
+/* What to do when the transfer queue is full. */
+enum overflow_policy {
+	/* Hold the transfer back, the device stalls until there is room. */
+	OVERFLOW_BLOCK,
+	/* Discard the oldest queued transfer. */
+	OVERFLOW_DROP_OLDEST,
+	/* Discard the incoming transfer. */
+	OVERFLOW_DROP_NEWEST,
+	/* Skip transfers progressively while the queue fills up. */
+	OVERFLOW_DECIMATE,
+};
+
+/*
+ * Bounded queue between USB reception and emission. Completed transfers
+ * wait here for the parser while spare transfers from the pool keep the
+ * bus busy. All arrays are sized when the transfer pool is allocated.
+ */
+struct transfer_queue {
+	struct libusb_transfer **ring;
+	unsigned int depth;
+	unsigned int head;
+	unsigned int count;
+	/* Pooled transfers which are neither in flight nor queued. */
+	struct libusb_transfer **idle;
+	unsigned int num_idle;
+	/* Completed transfers waiting for a free slot (OVERFLOW_BLOCK). */
+	struct libusb_transfer **held;
+	unsigned int num_held;
+	unsigned int decimation_phase;
+	/* Overflow counters, reset when an acquisition starts. */
+	unsigned int max_fill;
+	uint64_t num_blocked;
+	uint64_t num_dropped_oldest;
+	uint64_t num_dropped_newest;
+	uint64_t num_decimated;
+	/*
+	 * Flow control (OVERFLOW_BLOCK only): streaming is paused when the
+	 * queue fills up to the high watermark and resumed once it has
+	 * drained to the low watermark.
+	 */
+	gboolean flow_control;
+	gboolean paused;
+	unsigned int high_watermark;
+	unsigned int low_watermark;
+	int64_t pause_start_us;
+	int64_t paused_us;
+	uint64_t num_pauses;
+	uint64_t num_resumes;
+};
+
+enum trace_event_type {
+	TRACE_SUBMIT,
+	TRACE_TRANSFER,
+	TRACE_PARSE,
+};
+
+struct trace_event {
+	int64_t ts_us;
+	int64_t dur_us;
+	uint32_t bytes;
+	uint16_t track;
+	uint8_t type;
+};
+
+struct transfer_trace {
+	char *path;
+	int64_t start_us;
+	/* Submission time of every pooled transfer. */
+	int64_t *submit_us;
+	struct trace_event *events;
+	size_t num_events;
+	uint64_t num_lost;
+};
+
+/*
+ * Waiting for devices to come back after the firmware upload. They may
+ * come back on another bus, e.g. that of the SuperSpeed root hub, so they
+ * are told apart by identity: a plausible device with our firmware which
+ * was not on the bus when the wait started.
+ */
+struct renum_wait {
+	struct sr_context *ctx;
+	gboolean registered;
+	libusb_hotplug_callback_handle handle;
+	int arrived;
+	gboolean (*plausible)(const struct libusb_device_descriptor *des);
+	/* Bus and address of the devices which had the firmware already. */
+	GSList *present;
+};
+
+/*
+ * Devices of one session acquiring together. CMD_START goes out to all of
+ * them back to back once the last one is ready, and their streams are
+ * aligned to a common start on the host's clock. See sync_group_join().
+ */
+struct sync_group {
+	unsigned int num_members;
+	unsigned int num_ready;
+	/* CMD_START went out to all members. */
+	gboolean started;
+	/* A member left before the start, the others are stopped. */
+	gboolean cancelled;
+	gboolean cancelling;
+	/* Running members, struct sr_dev_inst. */
+	GSList *members;
+	/* Common start, the members drop all samples from before it. */
+	int64_t start_us;
+};
+
+/*
+ * Flags in FX3_CONF_MEMORY, a comma separated list of their names, see
+ * mem_flag_names in api.c.
+ */
+enum mem_flags {
+	/* mlock() the buffers. */
+	MEM_LOCK = 1 << 0,
+	/* Advise transparent huge pages. */
+	MEM_THP = 1 << 1,
+	/* Explicit huge pages from hugetlbfs, falling back to MEM_THP. */
+	MEM_HUGETLB = 1 << 2,
+	/* Touch every page at allocation. */
+	MEM_PREFAULT = 1 << 3,
+};
+
+/* A buffer which is mapped on its own when any mem_flags are set. */
+struct mem_region {
+	void *base;
+	/* Usable size and size of the mapping. */
+	size_t size;
+	size_t length;
+	/* The mem_flags asked for and which of them took effect. */
+	unsigned int flags;
+	unsigned int applied;
+	gboolean mapped;
+};
+
+enum analog_trigger_slope {
+	ANALOG_TRIGGER_RISING,
+	ANALOG_TRIGGER_FALLING,
+	ANALOG_TRIGGER_WINDOW,
+};
+
+/*
+ * Trigger on one channel of the analog packets. The thresholds form a
+ * hysteresis band: a rising trigger arms below low and fires above high,
+ * a falling one arms above high and fires below low. A window trigger
+ * arms inside [low, high] and fires outside of it.
+ */
+struct analog_trigger {
+	/* Channel of the analog packets, -1 if disabled. */
+	int source;
+	enum analog_trigger_slope slope;
+	double low;
+	double high;
+
+	/* Only used by the mso data path, while acquiring. */
+	gboolean active;
+	gboolean armed;
+	/*
+	 * Pre-trigger ring of whole samples, ANALOG_PACKET_CHANNELS values
+	 * each, sized from the capture ratio.
+	 */
+	float *ring;
+	size_t ring_size;
+	size_t ring_head;
+	size_t ring_fill;
+};
+
+/* Layout of a completed segment within its slot. */
+struct segment {
+	/* Oldest sample of the pre-trigger ring, 0 unless it wrapped. */
+	size_t ring_start;
+	/* Samples ahead of the trigger. */
+	size_t pre_samples;
+};
+
+/*
+ * Segmented capture, like the segmented memory of a scope. Instead of
+ * sending frames as they come in, segment_send_data_proc() writes every
+ * frame into its own preallocated slot. The start of a slot is its
+ * pre-trigger ring until the trigger fires, after which the rest of the
+ * frame is copied in behind it. The next slot is armed as soon as
+ * one is full. All frames are sent once the last slot is full or the
+ * acquisition stops.
+ */
+struct segment_store {
+	/* 0 unless capturing segmented. */
+	unsigned int num_slots;
+	size_t slot_samples;
+	size_t ring_size;
+	uint16_t *slots;
+	struct segment *segments;
+	/* Full slots, the next one is being captured. */
+	unsigned int num_done;
+	gboolean capturing;
+	/* Next sample of the current slot, while capturing. */
+	size_t pos;
+	size_t ring_head;
+	size_t ring_fill;
+};
+
+/*
+ * Flight recorder, for watching a signal for hours without sending it.
+ * The last FX3_CONF_RECORDER_WINDOW milliseconds of a continuous
+ * acquisition are kept in a ring and only sent, as one frame, when the
+ * trigger fires or the acquisition is stopped. After the trigger the ring
+ * keeps recording for the post-trigger part of the window, then it is
+ * frozen, sent and armed again.
+ */
+struct flight_recorder {
+	/* Samples in the window, 0 unless recording. */
+	size_t size;
+	/* Samples recorded from the trigger on before freezing. */
+	size_t post;
+	uint16_t *ring;
+	size_t head;
+	size_t fill;
+	gboolean triggered;
+	/* Post-trigger samples still to record. */
+	size_t remaining;
+	uint64_t num_dumps;
+};
+
+/*
+ * Deep capture into a file, for captures larger than memory. Samples go
+ * to the file instead of the session. The file starts with a header of
+ * SPILL_HEADER_SIZE bytes, struct spill_header. Blocks of
+ * SPILL_BLOCK_SAMPLES samples follow it, each holding one bit plane per
+ * channel, D0 first. The last block is padded with zeros. So sample s of
+ * channel c is bit s % 8 of byte
+ *
+ *   SPILL_HEADER_SIZE + (s / SPILL_BLOCK_SAMPLES) * block_bytes
+ *   + c * SPILL_BLOCK_SAMPLES / 8 + (s % SPILL_BLOCK_SAMPLES) / 8
+ *
+ * The file is written a window at a time through a shared mapping,
+ * the page cache does the writing behind.
+ */
+struct spill_header {
+	char magic[8];
+	/* Little endian from here on. */
+	uint32_t version;
+	uint32_t num_channels;
+	uint64_t samplerate;
+	uint64_t block_samples;
+	uint64_t num_samples;
+};
+
+struct spill_store {
+	/* -1 unless capturing into a file. */
+	int fd;
+	unsigned int num_channels;
+	size_t block_bytes;
+	/* Samples of the block being collected. */
+	uint16_t *block;
+	size_t block_fill;
+	uint8_t *map;
+	uint64_t map_offset;
+	size_t map_used;
+	uint64_t num_samples;
+	gboolean failed;
+};
+
+/* Block codecs of the compressed store. */
+enum cstore_codec {
+	/* Runs of equal samples, the sample and a varint run length each. */
+	CSTORE_RLE,
+	/*
+	 * The mask of the channels which do not change within the block and
+	 * their values, then a bit plane for each of the other channels.
+	 */
+	CSTORE_PLANES,
+	CSTORE_RAW,
+};
+
+struct cstore_block {
+	size_t offset;
+	uint16_t num_samples;
+	uint8_t codec;
+};
+
+/*
+ * Compressed capture, for deep captures of mostly idle signals. The
+ * logic data path compresses every block of CSTORE_BLOCK_SAMPLES samples
+ * as it fills up, with whichever codec makes it smallest, and sends the
+ * frame when it is complete. The index locates every block, so each can
+ * be decoded on its own. The store takes no more than the memory budget
+ * in FX3_CONF_COMPRESS_MEMORY, so the frame it can hold depends on how
+ * well the signal compresses.
+ */
+struct compressed_store {
+	/* Bytes available for compressed blocks, 0 unless compressing. */
+	size_t size;
+	size_t used;
+	uint8_t *data;
+	struct cstore_block *index;
+	size_t max_blocks;
+	size_t num_blocks;
+	/* Samples of the block being collected, or decoded. */
+	uint16_t *block;
+	size_t block_fill;
+	/* Out of space, the frame ends early. */
+	gboolean full;
+};
+
+/*
+ * Gathers the samples of many packets into a staging buffer, which goes
+ * out as one datafeed packet when it holds flush_samples, when the oldest
+ * sample in it is flush_us old, and at the end of a frame. The parser
+ * writes every analog packet right behind the samples held in
+ * analog_buffer, there is always room for one. Logic samples are packed
+ * into logic_buffer in logic_unitsize as they are queued.
+ */
+struct sample_emitter {
+	size_t fill;
+	size_t flush_samples;
+	int64_t flush_us;
+	int64_t first_us;
+};
+
+/* Bump allocator for the transient memory of an acquisition. */
+struct arena {
+	struct mem_region region;
+	size_t used;
+};
+
+struct cypress_fx3_mock;
+struct thread_tuning;
+
 struct dev_context {
 	const struct cypress_fx3_profile *profile;
 	GSList *enabled_analog_channels;
@@ -108,30 +565,93 @@ struct dev_context {
 	uint64_t cur_samplerate;
 	uint64_t limit_frames;
 	uint64_t limit_samples;
+	/* Stop after this long, 0 for no time limit. */
+	uint64_t limit_msec;
+	/* Host time of the start, for the time limit. */
+	int64_t acq_start_us;
+	gboolean continuous;
+	/* Flight recorder window in ms, 0 if off. */
+	uint64_t recorder_msec;
 	uint64_t capture_ratio;
 
 	gboolean trigger_fired;
 	gboolean acq_aborted;
+	/* SR_DF_END went out before the transfers were returned. */
+	gboolean end_sent;
 	gboolean sample_wide;
 	struct soft_trigger_logic *stl;
+	struct soft_trigger_prefilter prefilter;
+	struct analog_trigger analog_trigger;
+	struct segment_store segments;
+	struct flight_recorder recorder;
+	/* Capture file, samples go there instead of the session if set. */
+	char *spill_file;
+	struct spill_store spill;
+	/* Memory for compressed frames, see struct compressed_store. */
+	uint64_t compress_memory;
+	struct compressed_store cstore;
 
 	uint64_t num_frames;
 	uint64_t sent_samples;
 	int submitted_transfers;
 	int empty_transfer_count;
 
+	/* Transfer pool, kept across acquisitions. */
 	unsigned int num_transfers;
+	/* Freed by the last transfer to come back, libusb still owns some. */
+	gboolean free_deferred;
 	struct libusb_transfer **transfers;
+	size_t transfer_buffer_size;
+	struct transfer_queue queue;
+	uint64_t queue_depth;
+	enum overflow_policy overflow_policy;
+	enum acq_profile acq_profile;
+	/* Trace file for the next acquisitions, NULL if not tracing. */
+	char *trace_file;
+	/* Only set while tracing an acquisition. */
+	struct transfer_trace *trace;
+	/* Stands in for the hardware, see mock.c. */
+	struct cypress_fx3_mock *mock;
+
+	/* Only set while acquiring in a sync group. */
+	struct sync_group *sync_group;
+	/* Host time at which the device timestamps started at 0. */
+	int64_t sync_offset_us;
+	/* The samples from before the common start have been dropped. */
+	gboolean sync_aligned;
+	/* Samples emitted since the common start. */
+	uint64_t sync_sent;
+
+	/* Placement of the acquisition thread, see thread_tuning_apply(). */
+	char *cpus;
+	int numa_node;
+	int rt_priority;
+	/* Settings to restore on the tuned acquisition thread, if any. */
+	struct thread_tuning *tuning;
+	gboolean tuning_done;
+
+	/* From FX3_CONF_MEMORY. */
+	unsigned int mem_flags;
+	/* Queue, transfer buffers, staging buffers and parser scratch. */
+	struct arena arena;
+	float *packet_values;
+	uint16_t *packet_samples;
+	/* Decoded logic samples in the unit size of the soft trigger. */
+	uint8_t *trigger_buffer;
 	struct sr_context *ctx;
-	void (*send_data_proc)(struct sr_dev_inst *sdi,
-		uint8_t *data, size_t length, size_t sample_width);
+	uint64_t (*send_data_proc)(struct sr_dev_inst *sdi, uint8_t *data,
+		size_t length, uint64_t max_samples, size_t *consumed);
 	
 
 	float *analog_buffer;
 	size_t analog_buffer_size;
+	struct sample_emitter analog_emitter;
 
 	uint8_t *logic_buffer;  
 	size_t logic_buffer_size;
+	struct sample_emitter logic_emitter;
+	/* 1 when only D0-D7 are enabled, else 2. */
+	unsigned int logic_unitsize;
 };
 
 
@@ -148,11 +668,42 @@ struct parsed_packet {
     uint16_t ts_hi;   // <-- and this
 };
 
-int fx3driver_parse_next_packet(const uint8_t *data, size_t len, struct parsed_packet *pkt);
-
+/* channel_type of a packet the parser rejected, it carries no samples. */
+#define PACKET_TYPE_REJECTED	0x01
+
+int fx3driver_parse_next_packet(const uint8_t *data, size_t len,
+	struct parsed_packet *pkt, float *analog_values,
+	uint16_t *digital_values);
+
+SR_PRIV void cypress_fx3_renum_wait_init(struct renum_wait *w,
+	struct sr_context *ctx,
+	gboolean (*plausible)(const struct libusb_device_descriptor *des));
+SR_PRIV gboolean cypress_fx3_renum_is_new(const struct renum_wait *w,
+	libusb_device *dev);
+SR_PRIV int cypress_fx3_renum_wait_step(struct renum_wait *w,
+	int64_t deadline_us);
+SR_PRIV int cypress_fx3_renum_wait(struct renum_wait *w,
+	unsigned int num_devices, int64_t deadline_us);
+SR_PRIV void cypress_fx3_renum_wait_clear(struct renum_wait *w);
 SR_PRIV int cypress_fx3_dev_open(struct sr_dev_inst *sdi, struct sr_dev_driver *di);
 SR_PRIV struct dev_context *cypress_fx3_dev_new(void);
 SR_PRIV int cypress_fx3_start_acquisition(const struct sr_dev_inst *sdi);
 SR_PRIV void cypress_fx3_abort_acquisition(struct dev_context *devc);
+SR_PRIV int cypress_fx3_drain_transfers(struct dev_context *devc);
+SR_PRIV void cypress_fx3_free_buffers(struct dev_context *devc);
+
+SR_PRIV struct cypress_fx3_mock *cypress_fx3_mock_new(const char *path,
+	uint64_t rate, int64_t latency_us);
+SR_PRIV void cypress_fx3_mock_free(struct cypress_fx3_mock *mock);
+SR_PRIV int cypress_fx3_mock_open(struct cypress_fx3_mock *mock);
+SR_PRIV void cypress_fx3_mock_close(struct cypress_fx3_mock *mock);
+SR_PRIV int cypress_fx3_mock_control(struct cypress_fx3_mock *mock,
+	uint8_t request, uint8_t *data, uint16_t length);
+SR_PRIV void cypress_fx3_mock_stop(struct cypress_fx3_mock *mock);
+SR_PRIV int cypress_fx3_mock_submit_transfer(struct cypress_fx3_mock *mock,
+	struct libusb_transfer *transfer);
+SR_PRIV int cypress_fx3_mock_cancel_transfer(struct cypress_fx3_mock *mock,
+	struct libusb_transfer *transfer);
+SR_PRIV void cypress_fx3_mock_handle_events(struct cypress_fx3_mock *mock);
 
 #endif
@@ -517,6 +517,7 @@ static int dev_acquisition_start(const struct sr_dev_inst *sdi)
 		devc->stl = soft_trigger_logic_new(sdi, trigger, pre_trigger_samples);
 		if (!devc->stl)
 			return SR_ERR_MALLOC;
+		soft_trigger_prefilter_init(&devc->prefilter, devc->stl);
 
 		/* Disable all analog channels since using them when there are logic
 		 * triggers set up would require having pre-trigger sample buffers
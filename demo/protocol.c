@@ -818,9 +818,10 @@ SR_PRIV int demo_prepare_data(int fd, int revents, void *cb_data)
 			logic_generator(sdi, sending_now * devc->logic_unitsize);
 			/* Check for trigger and send pre-trigger data if needed */
 			if (devc->stl && (!devc->trigger_fired)) {
-				trigger_offset = soft_trigger_logic_check(devc->stl,
-						devc->logic_data, sending_now * devc->logic_unitsize,
-						&pre_trigger_samples);
+				trigger_offset = soft_trigger_prefilter_check(devc->stl,
+						&devc->prefilter, devc->logic_data,
+						sending_now * devc->logic_unitsize
+						/ devc->stl->unitsize, &pre_trigger_samples);
 				if (trigger_offset > -1) {
 					devc->trigger_fired = TRUE;
 					logic_done = pre_trigger_samples;
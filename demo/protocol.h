@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include <libsigrok/libsigrok.h>
 #include "libsigrok-internal.h"
+#include "soft-trigger-prefilter.h"
 #include <stdbool.h>
 
 
@@ -38,6 +39,7 @@
 
 /* The size in bytes of chunks to send through the session bus. */
 #define LOGIC_BUFSIZE			4096
+
 /* Size of the analog pattern space per channel. */
 #define ANALOG_BUFSIZE			4096
 /* This is a development feature: it starts a new frame every n samples. */
@@ -153,6 +155,7 @@ struct dev_context {
 	uint64_t capture_ratio;
 	gboolean trigger_fired;
 	struct soft_trigger_logic *stl;
+	struct soft_trigger_prefilter prefilter;
 };
 
 
@@ -0,0 +1,228 @@
+/*
+ * This file is part of the libsigrok project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include <libsigrok/libsigrok.h>
+#include "libsigrok-internal.h"
+#include "soft-trigger-prefilter.h"
+
+/*
+ * Pre-filter for the soft trigger, shared by the cypress-fx3 and demo
+ * drivers. The first stage of a trigger is turned into bit masks, so that
+ * long runs of samples which cannot match it are skipped a block at a
+ * time instead of being fed through soft_trigger_logic_check().
+ */
+
+SR_PRIV void soft_trigger_prefilter_init(struct soft_trigger_prefilter *f,
+	const struct soft_trigger_logic *stl)
+{
+	const struct sr_trigger_stage *stage;
+	const struct sr_trigger_match *match;
+	const GSList *l;
+	uint64_t bit;
+
+	memset(f, 0, sizeof(*f));
+	if (!stl || stl->unitsize > 8 || !stl->trigger->stages)
+		return;
+	stage = stl->trigger->stages->data;
+	if (!stage->matches)
+		return;
+
+	for (l = stage->matches; l; l = l->next) {
+		match = l->data;
+		if (!match->channel->enabled)
+			continue;
+		if (match->channel->type != SR_CHANNEL_LOGIC)
+			return;
+		bit = UINT64_C(1) << match->channel->index;
+		switch (match->match) {
+		case SR_TRIGGER_ZERO:
+			f->zero |= bit;
+			break;
+		case SR_TRIGGER_ONE:
+			f->one |= bit;
+			break;
+		case SR_TRIGGER_RISING:
+			f->rising |= bit;
+			break;
+		case SR_TRIGGER_FALLING:
+			f->falling |= bit;
+			break;
+		case SR_TRIGGER_EDGE:
+			f->edge |= bit;
+			break;
+		default:
+			return;
+		}
+	}
+	f->usable = TRUE;
+}
+
+static inline uint64_t load_sample(const uint8_t *p, int unitsize)
+{
+	uint64_t v;
+
+	v = 0;
+	memcpy(&v, p, unitsize);
+
+	return GUINT64_FROM_LE(v);
+}
+
+static inline gboolean prefilter_hit(const struct soft_trigger_prefilter *f,
+	uint64_t prev, uint64_t cur)
+{
+	return !((f->one & ~cur) | (f->zero & cur)
+		| (f->rising & (prev | ~cur)) | (f->falling & (~prev | cur))
+		| (f->edge & ~(prev ^ cur)));
+}
+
+#if defined(__GNUC__) && G_BYTE_ORDER == G_LITTLE_ENDIAN
+/*
+ * Skip blocks of TRIGGER_SCAN_BLOCK samples without a hit, all samples
+ * of a block are tested at once. Starts at sample i > 0, returns the
+ * first block with a hit or the incomplete block at the end.
+ */
+#define DEFINE_PREFILTER_SKIP(name, type) \
+static size_t name(const struct soft_trigger_prefilter *f, \
+	const uint8_t *buf, size_t i, size_t num_samples) \
+{ \
+	typedef type vec __attribute__((vector_size(TRIGGER_SCAN_BLOCK \
+		* sizeof(type)))); \
+	const vec zero = (vec){ 0 } + (type)f->zero; \
+	const vec one = (vec){ 0 } + (type)f->one; \
+	const vec rising = (vec){ 0 } + (type)f->rising; \
+	const vec falling = (vec){ 0 } + (type)f->falling; \
+	const vec edge = (vec){ 0 } + (type)f->edge; \
+	vec cur, prev, hit; \
+	uint64_t words[sizeof(vec) / 8], any; \
+	unsigned int w; \
+\
+	for (; i + TRIGGER_SCAN_BLOCK <= num_samples; i += TRIGGER_SCAN_BLOCK) { \
+		memcpy(&cur, buf + i * sizeof(type), sizeof(vec)); \
+		memcpy(&prev, buf + (i - 1) * sizeof(type), sizeof(vec)); \
+		hit = (vec)(((one & ~cur) | (zero & cur) \
+			| (rising & (prev | ~cur)) | (falling & (~prev | cur)) \
+			| (edge & ~(prev ^ cur))) == 0); \
+		memcpy(words, &hit, sizeof(vec)); \
+		for (any = 0, w = 0; w < ARRAY_SIZE(words); w++) \
+			any |= words[w]; \
+		if (any) \
+			break; \
+	} \
+\
+	return i; \
+}
+
+DEFINE_PREFILTER_SKIP(prefilter_skip_8, uint8_t)
+DEFINE_PREFILTER_SKIP(prefilter_skip_16, uint16_t)
+#endif
+
+static size_t prefilter_skip(const struct soft_trigger_prefilter *f,
+	const uint8_t *buf, size_t i, size_t num_samples, int unitsize)
+{
+#if defined(__GNUC__) && G_BYTE_ORDER == G_LITTLE_ENDIAN
+	if (unitsize == 1)
+		return prefilter_skip_8(f, buf, i, num_samples);
+	if (unitsize == 2)
+		return prefilter_skip_16(f, buf, i, num_samples);
+#else
+	(void)f;
+	(void)buf;
+	(void)num_samples;
+	(void)unitsize;
+#endif
+	return i;
+}
+
+/* Index of the first sample matching the first stage, or num_samples. */
+SR_PRIV size_t soft_trigger_prefilter_scan(
+	const struct soft_trigger_prefilter *f, const uint8_t *buf,
+	size_t num_samples, int unitsize, const uint8_t *prev_sample)
+{
+	uint64_t prev, cur;
+	size_t i, end;
+
+	prev = load_sample(prev_sample, unitsize);
+	i = 0;
+	while (i < num_samples) {
+		if (i > 0) {
+			i = prefilter_skip(f, buf, i, num_samples, unitsize);
+			prev = load_sample(buf + (i - 1) * unitsize, unitsize);
+		}
+		end = MIN(i + TRIGGER_SCAN_BLOCK, num_samples);
+		for (; i < end; i++) {
+			cur = load_sample(buf + i * unitsize, unitsize);
+			if (prefilter_hit(f, prev, cur))
+				return i;
+			prev = cur;
+		}
+	}
+
+	return num_samples;
+}
+
+/*
+ * soft_trigger_logic_check() with a pre-filter. While the trigger waits
+ * in its first stage, the samples before the next possible match of
+ * that stage are skipped. Of those, only the tail which fits into the
+ * pre-trigger buffer goes through the state machine, after setting its
+ * previous sample as if it had seen them all. Everything from a match
+ * on is checked exactly, a block at a time, until the trigger has
+ * either fired or fallen back to its first stage. Returns the index of
+ * the trigger sample or -1, like soft_trigger_logic_check().
+ */
+SR_PRIV int soft_trigger_prefilter_check(struct soft_trigger_logic *stl,
+	const struct soft_trigger_prefilter *f, uint8_t *buf,
+	size_t num_samples, int *pre_trigger_samples)
+{
+	size_t pos, hit, start, end, u;
+	int offset;
+
+	if (!f->usable)
+		return soft_trigger_logic_check(stl, buf,
+			num_samples * stl->unitsize, pre_trigger_samples);
+
+	u = stl->unitsize;
+	pos = 0;
+	while (pos < num_samples) {
+		start = pos;
+		if (stl->cur_stage == 0) {
+			hit = pos + soft_trigger_prefilter_scan(f, buf + pos * u,
+				num_samples - pos, u,
+				pos ? buf + (pos - 1) * u : stl->prev_sample);
+			start = hit - MIN(hit - pos,
+				(size_t)stl->pre_trigger_size / u);
+			if (start > pos)
+				memcpy(stl->prev_sample, buf + (start - 1) * u, u);
+			pos = hit;
+		}
+		end = MIN(pos + TRIGGER_SCAN_BLOCK, num_samples);
+		if (end > start) {
+			offset = soft_trigger_logic_check(stl, buf + start * u,
+				(end - start) * u, pre_trigger_samples);
+			if (offset >= 0)
+				return start + offset;
+		}
+		pos = end;
+	}
+
+	return -1;
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of the libsigrok project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBSIGROK_SOFT_TRIGGER_PREFILTER_H
+#define LIBSIGROK_SOFT_TRIGGER_PREFILTER_H
+
+#include <stdint.h>
+#include <glib.h>
+#include <libsigrok/libsigrok.h>
+#include "libsigrok-internal.h"
+
+/* Samples the soft trigger pre-filter tests per step. */
+#define TRIGGER_SCAN_BLOCK	32
+
+/*
+ * The first stage of a soft trigger as masks over the bits of a sample,
+ * for skipping samples which cannot match it. See
+ * soft_trigger_prefilter_check().
+ */
+struct soft_trigger_prefilter {
+	gboolean usable;
+	uint64_t zero;
+	uint64_t one;
+	uint64_t rising;
+	uint64_t falling;
+	uint64_t edge;
+};
+
+SR_PRIV void soft_trigger_prefilter_init(struct soft_trigger_prefilter *f,
+	const struct soft_trigger_logic *stl);
+SR_PRIV size_t soft_trigger_prefilter_scan(
+	const struct soft_trigger_prefilter *f, const uint8_t *buf,
+	size_t num_samples, int unitsize, const uint8_t *prev_sample);
+SR_PRIV int soft_trigger_prefilter_check(struct soft_trigger_logic *stl,
+	const struct soft_trigger_prefilter *f, uint8_t *buf,
+	size_t num_samples, int *pre_trigger_samples);
+
+#endif